@@ -0,0 +1,52 @@
+// measures what a coroutine switch costs, and a whole spawn, run and finish
+// usage: coroutine_bench
+#include "http_server.h"
+#include <stdio.h>
+#include <time.h>
+
+#define YIELD_ITERATIONS 10000000
+#define SPAWN_ITERATIONS 1000000
+
+static double now_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void keep_yielding(void *argument) {
+  long *remaining = argument;
+  while ((*remaining)-- > 0)
+    coroutine_yield();
+}
+
+static void do_nothing(void *argument) {}
+
+int main() {
+  Worker worker;
+  init_worker(&worker, 0, NULL);
+
+  // two coroutines taking turns. every yield switches into the scheduler and
+  // back out to the other coroutine, so two switches per yield
+  long remaining[2] = {YIELD_ITERATIONS / 2, YIELD_ITERATIONS / 2};
+  spawn_coroutine(&worker, keep_yielding, &remaining[0]);
+  spawn_coroutine(&worker, keep_yielding, &remaining[1]);
+
+  double start = now_seconds();
+  run_ready_coroutines(&worker);
+  double elapsed = now_seconds() - start;
+  printf("%d yields in %.3fs: %.1f ns per yield, %.1f ns per switch\n",
+         YIELD_ITERATIONS, elapsed, elapsed * 1e9 / YIELD_ITERATIONS,
+         elapsed * 1e9 / (2.0 * YIELD_ITERATIONS));
+
+  // after the first, every stack comes back out of the pool
+  start = now_seconds();
+  for (int i = 0; i < SPAWN_ITERATIONS; i++) {
+    spawn_coroutine(&worker, do_nothing, NULL);
+    run_ready_coroutines(&worker);
+  }
+  elapsed = now_seconds() - start;
+  printf("%d spawns in %.3fs: %.1f ns per spawn, run and finish\n",
+         SPAWN_ITERATIONS, elapsed, elapsed * 1e9 / SPAWN_ITERATIONS);
+
+  return 0;
+}
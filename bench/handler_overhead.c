@@ -0,0 +1,98 @@
+// measures what the handler layer adds to a request: route lookup, setting up
+// the request and response, building the headers and finishing. the response
+// goes over a unix socketpair, and the same bytes are also sent with a bare
+// send() so the syscall can be subtracted out
+// usage: handler_bench [iterations]
+#include "http_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_ROUTES 16
+
+static const char body[] = "hello world\n";
+
+static uint64_t now_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// sets its length up front, so the whole response is one write
+static int hello(const HandlerRequest *request, ResponseWriter *response) {
+  response_add_header(response, "Content-Type", "text/plain");
+  response_set_content_length(response, sizeof(body) - 1);
+  return response_write(response, body, sizeof(body) - 1);
+}
+
+static int do_nothing(const HandlerRequest *request,
+                      ResponseWriter *response) {
+  return 0;
+}
+
+static long drain(int socket, char *buffer, long length) {
+  long received = recv(socket, buffer, length, 0);
+  if (received <= 0) {
+    perror("recv");
+    exit(1);
+  }
+  return received;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+  // the route table looks like a real one, so the lookup isn't a single
+  // comparison
+  char prefixes[NUM_ROUTES][32];
+  for (int i = 0; i < NUM_ROUTES - 1; i++) {
+    snprintf(prefixes[i], sizeof(prefixes[i]), "/api/v%d", i);
+    register_handler(prefixes[i], do_nothing, NULL);
+  }
+  register_handler("/hello", hello, NULL);
+
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+    perror("socketpair");
+    return 1;
+  }
+
+  const char raw[] = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  HTTP_Request request = parse_http_request(raw);
+  const char *path = request.request_line.relative_path.path;
+  unsigned path_length = request.request_line.relative_path.path_length;
+
+  // one response to learn its bytes, for the baseline
+  char response[1024];
+  run_handler(sockets[0], find_handler_route(path, path_length), &request, raw,
+              sizeof(raw) - 1);
+  long response_length = drain(sockets[1], response, sizeof(response));
+
+  uint64_t start = now_nanoseconds();
+  for (long i = 0; i < iterations; i++) {
+    if (send(sockets[0], response, response_length, 0) != response_length) {
+      perror("send");
+      return 1;
+    }
+    drain(sockets[1], response, sizeof(response));
+  }
+  uint64_t bare = now_nanoseconds() - start;
+
+  start = now_nanoseconds();
+  for (long i = 0; i < iterations; i++) {
+    HandlerRoute *route = find_handler_route(path, path_length);
+    if (run_handler(sockets[0], route, &request, raw, sizeof(raw) - 1) == -1)
+      return 1;
+    drain(sockets[1], response, sizeof(response));
+  }
+  uint64_t handled = now_nanoseconds() - start;
+
+  printf("%ld requests: bare send %.1f ns, through a handler %.1f ns, "
+         "handler overhead %.1f ns\n",
+         iterations, (double)bare / iterations, (double)handled / iterations,
+         ((double)handled - bare) / iterations);
+  return 0;
+}
@@ -0,0 +1,119 @@
+// times whole requests, connect through the server closing the connection,
+// one at a time so each number is latency and not queueing
+// usage: socket_bench [requests] [path] [fastopen]
+// with fastopen the request rides in the SYN once the server has handed out
+// a cookie, which needs "socket fastopen <queue>" on the server
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT "5556"
+#define WARMUP_REQUESTS 50
+
+static uint64_t now_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// returns the bytes of response read, or -1
+static long request_once(struct addrinfo *address, const char *request,
+                         int request_length, int use_fastopen,
+                         uint64_t *first_byte) {
+  int client = socket(address->ai_family, address->ai_socktype,
+                      address->ai_protocol);
+  if (client == -1)
+    return -1;
+
+  long sent;
+  if (use_fastopen) {
+    sent = sendto(client, request, request_length, MSG_FASTOPEN,
+                  address->ai_addr, address->ai_addrlen);
+  } else {
+    if (connect(client, address->ai_addr, address->ai_addrlen) == -1) {
+      close(client);
+      return -1;
+    }
+    sent = send(client, request, request_length, 0);
+  }
+  if (sent != request_length) {
+    close(client);
+    return -1;
+  }
+
+  char buffer[16384];
+  long total = 0;
+  long received;
+  while ((received = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+    if (total == 0)
+      *first_byte = now_nanoseconds();
+    total += received;
+  }
+  close(client);
+  return received == 0 ? total : -1;
+}
+
+int main(int argc, char **argv) {
+  int num_requests = argc > 1 ? atoi(argv[1]) : 2000;
+  const char *path = argc > 2 ? argv[2] : "/";
+  int use_fastopen = argc > 3 && strcmp(argv[3], "fastopen") == 0;
+
+  struct addrinfo hints, *address;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", PORT, &hints, &address) != 0) {
+    fprintf(stderr, "getaddrinfo failed\n");
+    return 1;
+  }
+
+  char request[512];
+  int request_length =
+      snprintf(request, sizeof(request),
+               "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+
+  // the first fast open connection only fetches the cookie, and the first
+  // few of anything warm caches
+  uint64_t first_byte;
+  for (int i = 0; i < WARMUP_REQUESTS; i++)
+    request_once(address, request, request_length, use_fastopen, &first_byte);
+
+  uint64_t *totals = malloc(num_requests * sizeof(uint64_t));
+  uint64_t *first_bytes = malloc(num_requests * sizeof(uint64_t));
+  int failures = 0;
+  for (int i = 0; i < num_requests; i++) {
+    uint64_t start = now_nanoseconds();
+    first_byte = start;
+    if (request_once(address, request, request_length, use_fastopen,
+                     &first_byte) <= 0)
+      failures++;
+    totals[i] = now_nanoseconds() - start;
+    first_bytes[i] = first_byte - start;
+  }
+
+  qsort(totals, num_requests, sizeof(uint64_t), compare_u64);
+  qsort(first_bytes, num_requests, sizeof(uint64_t), compare_u64);
+  printf("%s%s: first byte p50 %.1fus p99 %.1fus, whole request p50 %.1fus "
+         "p99 %.1fus",
+         path, use_fastopen ? " (fastopen)" : "",
+         first_bytes[num_requests / 2] / 1e3,
+         first_bytes[num_requests * 99 / 100] / 1e3,
+         totals[num_requests / 2] / 1e3, totals[num_requests * 99 / 100] / 1e3);
+  if (failures)
+    printf(", %d failed", failures);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,48 @@
+#! /bin/sh
+# runs socket_bench against the server once per socket option, each on its
+# own, so their latency effects can be compared with the untuned baseline
+# usage: bench/socket_options.sh [build directory] [requests]
+# run from the repository root
+build=$(cd "${1:-build}" && pwd)
+requests=${2:-2000}
+
+run_dir=$(mktemp -d)
+ln -s "$(pwd)/files_to_serve" "$run_dir/files_to_serve"
+server=
+trap '[ -n "$server" ] && kill $server; rm -rf "$run_dir"' EXIT
+
+# a static file goes out with sendfile, /hello streams several small chunks,
+# which is where Nagle and delayed acks meet
+run() {
+    name=$1
+    shift
+    {
+        echo "handler_module $build/libhello_handler.so"
+        [ -n "$1" ] && echo "socket $*"
+    } > "$run_dir/tuke.conf"
+
+    (cd "$run_dir" && exec "$build/tuke_http_server" > /dev/null 2>&1) &
+    server=$!
+    sleep 0.5
+
+    echo "== $name"
+    fastopen=
+    [ "$name" = fastopen ] && fastopen=fastopen
+    "$build/socket_bench" "$requests" / $fastopen
+    "$build/socket_bench" "$requests" "/hello?name=a&name=b" $fastopen
+
+    kill $server
+    wait $server 2>/dev/null
+    server=
+}
+
+run baseline
+run backlog backlog 4096
+run defer_accept defer_accept 1
+run fastopen fastopen 256
+run nodelay nodelay on
+run cork cork on
+run busy_poll busy_poll 50
+run incoming_cpu incoming_cpu on
+run send_buffer send_buffer 262144
+run receive_buffer receive_buffer 262144
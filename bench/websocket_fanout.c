@@ -0,0 +1,245 @@
+// opens many websocket connections to a websocket_broadcast route, sends
+// timestamped messages down one of them and times how long each takes to
+// reach every connection
+// usage: websocket_bench [connections] [messages] [window] [path]
+// the server needs "websocket_broadcast /ws" (or the given path) in tuke.conf
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT "5556"
+#define PAYLOAD_LENGTH 16
+#define FRAME_LENGTH (2 + PAYLOAD_LENGTH)
+#define MAX_EVENTS 256
+
+typedef struct {
+  int socket;
+  unsigned char partial[FRAME_LENGTH];
+  unsigned partial_length;
+} Client;
+
+static Client *clients;
+static int num_clients;
+static uint64_t *sent_at;
+static uint64_t *finished_at;
+static int *still_to_arrive;
+static long deliveries = 0;
+static int completed = 0;
+
+static uint64_t now_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int connect_client(struct addrinfo *address, const char *path) {
+  int client = socket(address->ai_family, address->ai_socktype,
+                      address->ai_protocol);
+  if (client == -1 ||
+      connect(client, address->ai_addr, address->ai_addrlen) == -1) {
+    perror("connect");
+    exit(1);
+  }
+
+  char request[256];
+  int length = snprintf(request, sizeof(request),
+                        "GET %s HTTP/1.1\r\n"
+                        "Host: localhost\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                        "Sec-WebSocket-Version: 13\r\n\r\n",
+                        path);
+  if (send(client, request, length, 0) != length) {
+    perror("send handshake");
+    exit(1);
+  }
+
+  // read exactly up to the end of the response headers, so no frames get
+  // swallowed here
+  char response[512];
+  int received = 0;
+  while (received < 4 ||
+         memcmp(response + received - 4, "\r\n\r\n", 4) != 0) {
+    if (received == (int)sizeof(response) ||
+        recv(client, response + received, 1, 0) != 1) {
+      fprintf(stderr, "handshake failed\n");
+      exit(1);
+    }
+    received++;
+  }
+  if (strncmp(response, "HTTP/1.1 101", 12) != 0) {
+    fprintf(stderr, "handshake refused: %.*s\n", received, response);
+    exit(1);
+  }
+
+  fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+  return client;
+}
+
+// client frames have to be masked
+static void send_message(int sender, int sequence) {
+  unsigned char frame[2 + 4 + PAYLOAD_LENGTH];
+  uint64_t payload[2] = {(uint64_t)sequence, now_nanoseconds()};
+  uint32_t key = rand();
+
+  frame[0] = 0x82;
+  frame[1] = 0x80 | PAYLOAD_LENGTH;
+  memcpy(frame + 2, &key, 4);
+  memcpy(frame + 6, payload, PAYLOAD_LENGTH);
+  for (int i = 0; i < PAYLOAD_LENGTH; i++)
+    frame[6 + i] ^= frame[2 + (i & 3)];
+
+  sent_at[sequence] = payload[1];
+  long sent = 0;
+  while (sent < (long)sizeof(frame)) {
+    long result = send(sender, frame + sent, sizeof(frame) - sent, 0);
+    if (result == -1 && errno != EAGAIN && errno != EINTR) {
+      perror("send");
+      exit(1);
+    }
+    if (result > 0)
+      sent += result;
+  }
+}
+
+static void arrived(const unsigned char *frame) {
+  if (frame[0] != 0x82 || frame[1] != PAYLOAD_LENGTH) {
+    fprintf(stderr, "unexpected frame %02x %02x\n", frame[0], frame[1]);
+    exit(1);
+  }
+  uint64_t sequence;
+  memcpy(&sequence, frame + 2, 8);
+  deliveries++;
+  if (--still_to_arrive[sequence] == 0) {
+    finished_at[sequence] = now_nanoseconds();
+    completed++;
+  }
+}
+
+static void read_client(Client *client) {
+  unsigned char buffer[FRAME_LENGTH * 64];
+  while (1) {
+    long received = recv(client->socket, buffer, sizeof(buffer), 0);
+    if (received == 0) {
+      fprintf(stderr, "server closed a connection\n");
+      exit(1);
+    }
+    if (received == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      perror("recv");
+      exit(1);
+    }
+
+    long position = 0;
+    if (client->partial_length) {
+      long needed = FRAME_LENGTH - client->partial_length;
+      long taken = received < needed ? received : needed;
+      memcpy(client->partial + client->partial_length, buffer, taken);
+      client->partial_length += taken;
+      position = taken;
+      if (client->partial_length < FRAME_LENGTH)
+        continue;
+      arrived(client->partial);
+      client->partial_length = 0;
+    }
+    for (; position + FRAME_LENGTH <= received; position += FRAME_LENGTH)
+      arrived(buffer + position);
+    client->partial_length = received - position;
+    memcpy(client->partial, buffer + position, client->partial_length);
+  }
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  num_clients = argc > 1 ? atoi(argv[1]) : 10000;
+  int num_messages = argc > 2 ? atoi(argv[2]) : 200;
+  int window = argc > 3 ? atoi(argv[3]) : 8;
+  const char *path = argc > 4 ? argv[4] : "/ws";
+
+  // every connection is an fd, the default soft limit is usually too low
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  struct addrinfo hints, *address;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", PORT, &hints, &address) != 0) {
+    fprintf(stderr, "getaddrinfo failed\n");
+    return 1;
+  }
+
+  clients = calloc(num_clients, sizeof(Client));
+  sent_at = calloc(num_messages, sizeof(uint64_t));
+  finished_at = calloc(num_messages, sizeof(uint64_t));
+  still_to_arrive = calloc(num_messages, sizeof(int));
+
+  int epoll_fd = epoll_create1(0);
+  uint64_t connect_start = now_nanoseconds();
+  for (int i = 0; i < num_clients; i++) {
+    clients[i].socket = connect_client(address, path);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &clients[i]};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].socket, &event);
+  }
+  printf("%d connections upgraded in %.3fs\n", num_clients,
+         (now_nanoseconds() - connect_start) / 1e9);
+
+  // the sender is subscribed too, so it gets its own messages back
+  for (int i = 0; i < num_messages; i++)
+    still_to_arrive[i] = num_clients;
+
+  struct epoll_event events[MAX_EVENTS];
+  int next_message = 0;
+  uint64_t start = now_nanoseconds();
+  while (completed < num_messages) {
+    while (next_message < num_messages &&
+           next_message - completed < window)
+      send_message(clients[0].socket, next_message++);
+
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 5000);
+    if (ready == 0) {
+      fprintf(stderr, "timed out with %d of %d messages fanned out\n",
+              completed, num_messages);
+      return 1;
+    }
+    for (int i = 0; i < ready; i++)
+      read_client(events[i].data.ptr);
+  }
+  double elapsed = (now_nanoseconds() - start) / 1e9;
+
+  uint64_t *latencies = malloc(num_messages * sizeof(uint64_t));
+  for (int i = 0; i < num_messages; i++)
+    latencies[i] = finished_at[i] - sent_at[i];
+  qsort(latencies, num_messages, sizeof(uint64_t), compare_u64);
+
+  printf("%d messages to %d connections, window %d: %.0f msgs/s sent, %.0f "
+         "msgs/s delivered\n",
+         num_messages, num_clients, window, num_messages / elapsed,
+         deliveries / elapsed);
+  printf("fan-out latency, until the last connection has it: p50 %.3fms p99 "
+         "%.3fms max %.3fms\n",
+         latencies[num_messages / 2] / 1e6,
+         latencies[num_messages * 99 / 100] / 1e6,
+         latencies[num_messages - 1] / 1e6);
+  return 0;
+}
@@ -0,0 +1,42 @@
+#! /bin/sh
+# a keep-alive HTTP/1.1 backend to point proxy routes at while testing
+# usage: ./dummy_backend.sh [port]
+python3 - "${1:-8081}" <<'PY'
+import sys
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # keep-alive responses go out in several small writes, don't let nagle
+    # wait on the proxy's delayed ack between them
+    disable_nagle_algorithm = True
+
+    def respond(self, body):
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        self.respond(("backend %s saw %s\n" % (sys.argv[1], self.path)).encode())
+
+    def read_body(self):
+        if "chunked" not in self.headers.get("Transfer-Encoding", ""):
+            return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        body = b""
+        while True:
+            size = int(self.rfile.readline().split(b";")[0], 16)
+            if size == 0:
+                break
+            body += self.rfile.read(size)
+            self.rfile.readline()
+        while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+            pass
+        return body
+
+    def do_POST(self):
+        self.respond(self.read_body())
+
+ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
+PY
@@ -0,0 +1,54 @@
+#include "http_server.h"
+#include <string.h>
+
+#define MAX_NAME_LENGTH 256
+
+// GET /hello?name=tuke&name=musashi says hello to every name in the query
+static int hello(const HandlerRequest *request, ResponseWriter *response) {
+  response_add_header(response, "Content-Type", "text/plain; charset=utf-8");
+
+  QueryIterator query =
+      iterate_query(&request->http->request_line.relative_path);
+  QueryParam param;
+  int greeted = 0;
+
+  while (next_query_param(&query, &param)) {
+    if (!query_param_is(&param, "name") ||
+        param.value_length > MAX_NAME_LENGTH)
+      continue;
+
+    char name[MAX_NAME_LENGTH];
+    long name_length = percent_decode(param.value, param.value_length, name,
+                                      param.plus_is_space);
+    if (name_length == -1)
+      return -1;
+
+    response_write(response, "hello ", 6);
+    response_write(response, name, name_length);
+    response_write(response, "\n", 1);
+    greeted = 1;
+  }
+
+  if (!greeted)
+    response_write(response, "hello world\n", 12);
+  return 0;
+}
+
+// POST /echo sends the body back, however much of it there is
+static int echo(const HandlerRequest *request, ResponseWriter *response) {
+  response_add_header(response, "Content-Type", "application/octet-stream");
+
+  char buffer[4096];
+  long received;
+  while ((received = request_read(request, buffer, sizeof(buffer))) > 0) {
+    if (response_write(response, buffer, received) == -1)
+      return -1;
+  }
+  return received;
+}
+
+int tuke_register_handlers() {
+  if (register_handler("/hello", hello, NULL) == -1)
+    return -1;
+  return register_handler("/echo", echo, NULL);
+}
@@ -0,0 +1,263 @@
+#include "http_server.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bodies up to this size go out in the same writev as their headers, bigger
+// ones are sendfile'd out of the bundle
+#define SMALL_ASSET_LENGTH 16384
+
+static const char *bundle = NULL;
+static uint64_t bundle_size = 0;
+static int bundle_fd = -1;
+static const AssetEntry *entries = NULL;
+static uint32_t num_assets = 0;
+
+// asset_bundle <path>
+// only the header is checked here, opening costs the same no matter how many
+// assets are packed
+int open_asset_bundle(int argc, char **argv) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: asset_bundle path/to/assets.bundle\n");
+    return -1;
+  }
+
+  int fd = open(argv[0], O_RDONLY);
+  if (fd == -1) {
+    perror("opening asset bundle");
+    return -1;
+  }
+
+  struct stat bundle_stat;
+  if (fstat(fd, &bundle_stat) == -1 ||
+      bundle_stat.st_size < (off_t)sizeof(AssetBundleHeader)) {
+    fprintf(stderr, "%s is too small to be an asset bundle\n", argv[0]);
+    close(fd);
+    return -1;
+  }
+
+  void *mapped =
+      mmap(NULL, bundle_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    perror("mmap asset bundle");
+    close(fd);
+    return -1;
+  }
+
+  const AssetBundleHeader *header = mapped;
+  if (memcmp(header->magic, ASSET_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != ASSET_BUNDLE_VERSION ||
+      header->file_size != (uint64_t)bundle_stat.st_size ||
+      header->entries_offset +
+              (uint64_t)header->num_assets * sizeof(AssetEntry) >
+          header->file_size) {
+    fprintf(stderr, "%s is not a version %d asset bundle\n", argv[0],
+            ASSET_BUNDLE_VERSION);
+    munmap(mapped, bundle_stat.st_size);
+    close(fd);
+    return -1;
+  }
+
+  bundle = mapped;
+  bundle_size = bundle_stat.st_size;
+  bundle_fd = fd;
+  entries = (const AssetEntry *)(bundle + header->entries_offset);
+  num_assets = header->num_assets;
+  printf("serving %u assets from %s\n", num_assets, argv[0]);
+  return 0;
+}
+
+static int is_in_bundle(uint64_t offset, uint64_t length) {
+  return offset <= bundle_size && length <= bundle_size - offset;
+}
+
+static int compare_path(const AssetEntry *entry, const char *path,
+                        unsigned path_length) {
+  unsigned shorter =
+      entry->path_length < path_length ? entry->path_length : path_length;
+  int result = memcmp(bundle + entry->path_offset, path, shorter);
+  if (result)
+    return result;
+  return (entry->path_length > path_length) - (entry->path_length < path_length);
+}
+
+// binary search over the sorted index, touching only the pages it lands on
+const AssetEntry *find_asset(const char *path, unsigned path_length) {
+  if (!bundle)
+    return NULL;
+
+  if (path_length == 1 && path[0] == '/') {
+    path = "/index.html";
+    path_length = 11;
+  }
+
+  uint32_t low = 0;
+  uint32_t high = num_assets;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    const AssetEntry *entry = &entries[middle];
+    if (!is_in_bundle(entry->path_offset, entry->path_length))
+      return NULL;
+
+    int comparison = compare_path(entry, path, path_length);
+    if (comparison == 0) {
+      int is_sane =
+          is_in_bundle(entry->headers_offset, entry->headers_length) &&
+          is_in_bundle(entry->body_offset, entry->body_length) &&
+          is_in_bundle(entry->gzip_headers_offset,
+                       entry->gzip_headers_length) &&
+          is_in_bundle(entry->gzip_body_offset, entry->gzip_body_length);
+      return is_sane ? entry : NULL;
+    }
+    if (comparison < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return NULL;
+}
+
+// an Accept-Encoding element is a coding with an optional weight, like
+// gzip;q=0.5. it allows the coding unless the weight is zero, 0 and 0.000
+// alike, and a weight is only above zero if it has a nonzero digit
+static int element_allows(const char *weight, const char *end) {
+  while (weight < end && (*weight == ';' || *weight == ' ' || *weight == '\t'))
+    weight++;
+  if (end - weight < 2 || (weight[0] | 0x20) != 'q' || weight[1] != '=')
+    return 1;
+  for (const char *c = weight + 2; c < end; c++) {
+    if (*c >= '1' && *c <= '9')
+      return 1;
+  }
+  return 0;
+}
+
+// gzip is served if the client lists it, or * when it doesn't name gzip
+// itself, with a weight above zero
+static int accepts_gzip(const HTTP_Request *request) {
+  const Header *header = find_header(request, "Accept-Encoding");
+  if (!header)
+    return 0;
+
+  const char *cursor = header->body_string;
+  const char *end = header->body_string + header->body_length;
+  const char *element;
+  unsigned length;
+  int gzip = -1;
+  int any = -1;
+
+  while (next_list_element(&cursor, end, &element, &length)) {
+    const char *element_end = element + length;
+    const char *coding_end = memchr(element, ';', length);
+    if (!coding_end)
+      coding_end = element_end;
+    const char *weight = coding_end;
+    while (coding_end > element &&
+           (coding_end[-1] == ' ' || coding_end[-1] == '\t'))
+      coding_end--;
+
+    unsigned coding_length = coding_end - element;
+    if (coding_length == 4 && strncasecmp(element, "gzip", 4) == 0)
+      gzip = element_allows(weight, element_end);
+    else if (coding_length == 1 && *element == '*')
+      any = element_allows(weight, element_end);
+  }
+
+  return gzip != -1 ? gzip : any == 1;
+}
+
+// etag is the one for the variant that would be served
+static int etag_matches(const HTTP_Request *request, const char *etag) {
+  const Header *header = find_header(request, "If-None-Match");
+  if (!header)
+    return 0;
+  if (header->body_length == 1 && header->body_string[0] == '*')
+    return 1;
+  return header_has_token(header, etag);
+}
+
+static int send_not_modified(int client_socket, const char *etag,
+                             int has_variants) {
+  char response[128];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.0 304\r\n%sETag: %s\r\n\r\n",
+                        has_variants ? "Vary: Accept-Encoding\r\n" : "", etag);
+  long sent_bytes;
+  return send_all(client_socket, response, length, &sent_bytes);
+}
+
+static int send_large_asset(int client_socket, uint64_t headers_offset,
+                            uint64_t headers_length, uint64_t body_offset,
+                            uint64_t body_length) {
+  // MSG_MORE holds the headers back to go out with the first of the body
+  long sent_bytes = co_send(client_socket, bundle + headers_offset,
+                            headers_length, MSG_MORE);
+  if (sent_bytes == -1)
+    return -1;
+  if (sent_bytes < (long)headers_length &&
+      send_all(client_socket, bundle + headers_offset + sent_bytes,
+               headers_length - sent_bytes, &sent_bytes) == -1)
+    return -1;
+
+  off_t offset = body_offset;
+  uint64_t remaining = body_length;
+  while (remaining > 0) {
+    long sent = co_sendfile(client_socket, bundle_fd, &offset, remaining);
+    if (sent == -1) {
+      perror("sendfile");
+      return -1;
+    }
+    if (sent == 0)
+      break;
+    remaining -= sent;
+  }
+
+  return 0;
+}
+
+int serve_asset(int client_socket, const AssetEntry *asset,
+                const HTTP_Request *request) {
+  uint64_t headers_offset = asset->headers_offset;
+  uint64_t headers_length = asset->headers_length;
+  uint64_t body_offset = asset->body_offset;
+  uint64_t body_length = asset->body_length;
+  const char *etag = asset->etag;
+
+  if (asset->gzip_body_length && accepts_gzip(request)) {
+    headers_offset = asset->gzip_headers_offset;
+    headers_length = asset->gzip_headers_length;
+    body_offset = asset->gzip_body_offset;
+    body_length = asset->gzip_body_length;
+    etag = asset->gzip_etag;
+  }
+
+  if (etag_matches(request, etag))
+    return send_not_modified(client_socket, etag,
+                             asset->gzip_body_length != 0);
+
+  RequestLine request_line = request->request_line;
+  if (request_line.method_length == 4 &&
+      memcmp(request_line.method, "HEAD", 4) == 0)
+    body_length = 0;
+
+  // small bodies come straight out of the mapping in one syscall
+  if (body_length <= SMALL_ASSET_LENGTH) {
+    struct iovec spans[2] = {
+        {(void *)(bundle + headers_offset), headers_length},
+        {(void *)(bundle + body_offset), body_length},
+    };
+    return writev_all(client_socket, spans, 2);
+  }
+
+  cork_connection(client_socket);
+  int status = send_large_asset(client_socket, headers_offset, headers_length,
+                                body_offset, body_length);
+  uncork_connection(client_socket);
+  return status;
+}
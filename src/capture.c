@@ -0,0 +1,237 @@
+#include "http_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// workers append records to filling under the mutex, which is only a memcpy.
+// the writer thread swaps the buffers and does the file io, so capture never
+// makes a request wait on disk. when the writer falls behind records are
+// dropped rather than making workers wait. the last stretch of the buffer is
+// kept for END records, so a connection that lost records can still say so
+static struct {
+  int is_on;
+  FILE *file;
+  uint64_t started_at;
+  uint64_t next_connection;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t has_records;
+  char *filling;
+  unsigned long filling_length;
+  char *writing;
+  unsigned long dropped;
+} capture;
+
+#define WRITER_INTERVAL_MS 100
+#define END_RECORD_RESERVE (64 * 1024)
+
+// returns -1 if the record was dropped
+static int append_record(const CaptureRecord *record, const void *data) {
+  unsigned long length = sizeof(*record) + (data ? record->length : 0);
+  int is_ending =
+      record->type == CAPTURE_DROPPED || record->type == CAPTURE_END;
+  unsigned long limit = is_ending ? CAPTURE_BUFFER_LENGTH
+                                  : CAPTURE_BUFFER_LENGTH - END_RECORD_RESERVE;
+
+  pthread_mutex_lock(&capture.mutex);
+  if (capture.filling_length + length > limit) {
+    capture.dropped++;
+    pthread_mutex_unlock(&capture.mutex);
+    return -1;
+  }
+  memcpy(capture.filling + capture.filling_length, record, sizeof(*record));
+  if (data)
+    memcpy(capture.filling + capture.filling_length + sizeof(*record), data,
+           record->length);
+  capture.filling_length += length;
+  if (capture.filling_length > CAPTURE_BUFFER_LENGTH / 2)
+    pthread_cond_signal(&capture.has_records);
+  pthread_mutex_unlock(&capture.mutex);
+  return 0;
+}
+
+static void *write_capture(void *argument) {
+  unsigned long reported_drops = 0;
+
+  pthread_mutex_lock(&capture.mutex);
+  while (1) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WRITER_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&capture.has_records, &capture.mutex, &deadline);
+    if (capture.filling_length == 0)
+      continue;
+
+    char *full = capture.filling;
+    unsigned long length = capture.filling_length;
+    unsigned long dropped = capture.dropped;
+    capture.filling = capture.writing;
+    capture.filling_length = 0;
+    capture.writing = full;
+    pthread_mutex_unlock(&capture.mutex);
+
+    if (fwrite(full, 1, length, capture.file) != length ||
+        fflush(capture.file) != 0)
+      perror("writing capture");
+    if (dropped > reported_drops) {
+      fprintf(stderr, "capture fell behind, %lu records dropped so far\n",
+              dropped);
+      reported_drops = dropped;
+    }
+
+    pthread_mutex_lock(&capture.mutex);
+  }
+  return NULL;
+}
+
+// capture <path>
+// every client connection's inbound bytes, and the status and length of what
+// went back, are logged to path for tools/replay_capture.c
+int open_capture(int argc, char **argv) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: capture path/to/capture.log\n");
+    return -1;
+  }
+  if (capture.is_on) {
+    fprintf(stderr, "already capturing\n");
+    return -1;
+  }
+
+  capture.file = fopen(argv[0], "wb");
+  if (!capture.file) {
+    perror("opening capture");
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  CaptureHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  header.started_at = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  if (fwrite(&header, sizeof(header), 1, capture.file) != 1) {
+    perror("writing capture header");
+    fclose(capture.file);
+    return -1;
+  }
+
+  capture.filling = malloc(CAPTURE_BUFFER_LENGTH);
+  capture.writing = malloc(CAPTURE_BUFFER_LENGTH);
+  if (!capture.filling || !capture.writing) {
+    fprintf(stderr, "no memory for capture buffers\n");
+    return -1;
+  }
+  pthread_mutex_init(&capture.mutex, NULL);
+  pthread_cond_init(&capture.has_records, NULL);
+  capture.started_at = monotonic_nanoseconds();
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, write_capture, NULL) != 0) {
+    fprintf(stderr, "failed to start capture writer\n");
+    return -1;
+  }
+  pthread_detach(writer);
+
+  capture.is_on = 1;
+  printf("capturing traffic to %s\n", argv[0]);
+  return 0;
+}
+
+static uint64_t since_start(uint64_t timestamp) {
+  return timestamp > capture.started_at ? timestamp - capture.started_at : 0;
+}
+
+// only the connection a coroutine is serving is captured, so the sockets it
+// opens to backends along the way aren't mistaken for clients
+static CapturedConnection *captured(int socket) {
+  if (!capture.is_on)
+    return NULL;
+  Coroutine *coroutine = current_coroutine();
+  if (!coroutine || !coroutine->capture ||
+      coroutine->capture->socket != socket)
+    return NULL;
+  return coroutine->capture;
+}
+
+void start_capture(int socket, uint64_t accepted_at) {
+  Coroutine *coroutine = current_coroutine();
+  if (!capture.is_on || !coroutine)
+    return;
+
+  CapturedConnection *connection = malloc(sizeof(CapturedConnection));
+  if (!connection)
+    return;
+  connection->id =
+      __atomic_fetch_add(&capture.next_connection, 1, __ATOMIC_RELAXED);
+  connection->socket = socket;
+  connection->status = 0;
+  connection->sent_bytes = 0;
+  connection->saw_close = 0;
+  connection->is_incomplete = 0;
+  coroutine->capture = connection;
+
+  // untimed requests have no accept time, so the open is stamped when the
+  // worker picks the connection up instead
+  if (!accepted_at)
+    accepted_at = monotonic_nanoseconds();
+  CaptureRecord record = {since_start(accepted_at), connection->id, 0,
+                          CAPTURE_OPEN, 0};
+  if (append_record(&record, NULL) == -1)
+    connection->is_incomplete = 1;
+}
+
+// a length of 0 is the client closing its side, which the replayer has to do
+// too or the server waits on it forever
+void capture_received(int socket, const void *data, long length) {
+  CapturedConnection *connection = captured(socket);
+  if (!connection || connection->is_incomplete || length < 0 ||
+      (length == 0 && connection->saw_close))
+    return;
+
+  CaptureRecord record = {since_start(monotonic_nanoseconds()),
+                          connection->id, length,
+                          length ? CAPTURE_DATA : CAPTURE_CLOSE, 0};
+  if (append_record(&record, length ? data : NULL) == -1)
+    connection->is_incomplete = 1;
+  else if (!length)
+    connection->saw_close = 1;
+}
+
+// data is NULL for bytes that never passed through memory, like sendfile's
+void capture_sent(int socket, const void *data, long length) {
+  CapturedConnection *connection = captured(socket);
+  if (!connection || length <= 0)
+    return;
+
+  // the first thing sent is the status line
+  if (connection->sent_bytes == 0 && data && length >= 12 &&
+      memcmp(data, "HTTP/1.", 7) == 0)
+    connection->status = atoi((const char *)data + 9);
+  connection->sent_bytes += length;
+}
+
+void finish_capture() {
+  Coroutine *coroutine = current_coroutine();
+  if (!coroutine || !coroutine->capture)
+    return;
+
+  CapturedConnection *connection = coroutine->capture;
+  if (connection->is_incomplete) {
+    CaptureRecord dropped = {since_start(monotonic_nanoseconds()),
+                             connection->id, 0, CAPTURE_DROPPED, 0};
+    append_record(&dropped, NULL);
+  }
+  CaptureRecord record = {since_start(monotonic_nanoseconds()),
+                          connection->id,
+                          (uint32_t)connection->sent_bytes, CAPTURE_END,
+                          (uint16_t)connection->status};
+  append_record(&record, NULL);
+  coroutine->capture = NULL;
+  free(connection);
+}
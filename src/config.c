@@ -0,0 +1,77 @@
+#include "http_server.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_CONFIG_LINE 1024
+#define MAX_CONFIG_ARGS 16
+
+// splits a config line on whitespace in place, stopping at a '#' comment
+static int tokenize_line(char *line, char **argv) {
+  int argc = 0;
+  char *c = line;
+
+  while (*c && argc < MAX_CONFIG_ARGS) {
+    while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')
+      c++;
+    if (*c == '\0' || *c == '#')
+      break;
+
+    argv[argc++] = c;
+    while (*c && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n')
+      c++;
+    if (*c)
+      *c++ = '\0';
+  }
+
+  return argc;
+}
+
+// config is one directive per line, the first word picks the directive and
+// the rest are its arguments. a missing config file is not an error
+int load_config(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return 0;
+
+  char line[MAX_CONFIG_LINE];
+  char *argv[MAX_CONFIG_ARGS];
+  int line_number = 0;
+  int errors = 0;
+
+  while (fgets(line, MAX_CONFIG_LINE, file)) {
+    line_number++;
+    int argc = tokenize_line(line, argv);
+    if (argc == 0)
+      continue;
+
+    int status = -1;
+    if (strcmp(argv[0], "proxy") == 0) {
+      status = add_proxy_route(argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "handler_module") == 0) {
+      status = load_handler_module(argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "websocket_broadcast") == 0) {
+      status = add_websocket_broadcast_route(argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "socket") == 0) {
+      status = set_socket_option(argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "capture") == 0) {
+      status = open_capture(argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "slow_request_ms") == 0) {
+      status = set_slow_request_threshold(argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "asset_bundle") == 0) {
+      status = open_asset_bundle(argc - 1, argv + 1);
+    } else {
+      fprintf(stderr, "%s:%d: unknown directive %s\n", path, line_number,
+              argv[0]);
+      errors++;
+      continue;
+    }
+
+    if (status == -1) {
+      fprintf(stderr, "%s:%d: bad config line\n", path, line_number);
+      errors++;
+    }
+  }
+
+  fclose(file);
+  return errors ? -1 : 0;
+}
@@ -0,0 +1,490 @@
+#include "http_server.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define GUARD_PAGE_SIZE 4096
+
+// the worker whose event loop is running on this thread, if any
+static __thread Worker *current_worker = NULL;
+
+// saves the callee saved registers on the current stack, stores the stack
+// pointer in *save, then switches to the stack at load and pops its registers.
+// everything caller saved has already been spilled by the compiler at the
+// call, so that's all a switch needs
+void switch_context(void **save, void *load);
+
+#if defined(__x86_64__)
+__asm__(".text\n"
+        ".globl switch_context\n"
+        ".hidden switch_context\n"
+        ".type switch_context, @function\n"
+        "switch_context:\n"
+        "  pushq %rbp\n"
+        "  pushq %rbx\n"
+        "  pushq %r12\n"
+        "  pushq %r13\n"
+        "  pushq %r14\n"
+        "  pushq %r15\n"
+        "  movq %rsp, (%rdi)\n"
+        "  movq %rsi, %rsp\n"
+        "  popq %r15\n"
+        "  popq %r14\n"
+        "  popq %r13\n"
+        "  popq %r12\n"
+        "  popq %rbx\n"
+        "  popq %rbp\n"
+        "  ret\n"
+        ".size switch_context, .-switch_context\n");
+
+#define SAVED_FRAME_SIZE (8 * 8)
+#elif defined(__aarch64__)
+__asm__(".text\n"
+        ".globl switch_context\n"
+        ".hidden switch_context\n"
+        ".type switch_context, %function\n"
+        "switch_context:\n"
+        "  sub sp, sp, #176\n"
+        "  stp x19, x20, [sp, #0]\n"
+        "  stp x21, x22, [sp, #16]\n"
+        "  stp x23, x24, [sp, #32]\n"
+        "  stp x25, x26, [sp, #48]\n"
+        "  stp x27, x28, [sp, #64]\n"
+        "  stp x29, x30, [sp, #80]\n"
+        "  stp d8, d9, [sp, #96]\n"
+        "  stp d10, d11, [sp, #112]\n"
+        "  stp d12, d13, [sp, #128]\n"
+        "  stp d14, d15, [sp, #144]\n"
+        "  mov x9, sp\n"
+        "  str x9, [x0]\n"
+        "  mov sp, x1\n"
+        "  ldp x19, x20, [sp, #0]\n"
+        "  ldp x21, x22, [sp, #16]\n"
+        "  ldp x23, x24, [sp, #32]\n"
+        "  ldp x25, x26, [sp, #48]\n"
+        "  ldp x27, x28, [sp, #64]\n"
+        "  ldp x29, x30, [sp, #80]\n"
+        "  ldp d8, d9, [sp, #96]\n"
+        "  ldp d10, d11, [sp, #112]\n"
+        "  ldp d12, d13, [sp, #128]\n"
+        "  ldp d14, d15, [sp, #144]\n"
+        "  add sp, sp, #176\n"
+        "  ret\n"
+        ".size switch_context, .-switch_context\n");
+
+#define SAVED_FRAME_SIZE 176
+#else
+#error "switch_context is only written for x86_64 and aarch64"
+#endif
+
+void init_worker(Worker *worker, int index, void (*serve_task)(Task *)) {
+  memset(worker, 0, sizeof(*worker));
+  worker->index = index;
+  worker->serve_task = serve_task;
+  worker->queue = new_task_queue();
+  pthread_mutex_init(&worker->queue_mutex, NULL);
+  pthread_mutex_init(&worker->wake_mutex, NULL);
+
+  worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->epoll_fd == -1 || worker->wake_fd == -1) {
+    perror("creating worker event loop");
+    exit(1);
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = worker->wake_fd;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) ==
+      -1) {
+    perror("epoll_ctl wake fd");
+    exit(1);
+  }
+
+  worker->free_stacks = malloc(sizeof(char *) * MAX_POOLED_STACKS);
+}
+
+// a stack is one mapping with a PROT_NONE page at the bottom, so running off
+// the end faults instead of scribbling on a neighbour
+static char *take_stack(Worker *worker) {
+  if (worker->num_free_stacks > 0)
+    return worker->free_stacks[--worker->num_free_stacks];
+
+  char *stack = mmap(NULL, GUARD_PAGE_SIZE + COROUTINE_STACK_SIZE,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    perror("mmap coroutine stack");
+    return NULL;
+  }
+  if (mprotect(stack, GUARD_PAGE_SIZE, PROT_NONE) == -1) {
+    perror("mprotect guard page");
+    munmap(stack, GUARD_PAGE_SIZE + COROUTINE_STACK_SIZE);
+    return NULL;
+  }
+  return stack;
+}
+
+static void release_stack(Worker *worker, char *stack) {
+  if (worker->num_free_stacks < MAX_POOLED_STACKS) {
+    worker->free_stacks[worker->num_free_stacks++] = stack;
+    return;
+  }
+  munmap(stack, GUARD_PAGE_SIZE + COROUTINE_STACK_SIZE);
+}
+
+// first thing every coroutine runs, reached through switch_context's ret
+static void coroutine_main() {
+  Worker *worker = current_worker;
+  Coroutine *coroutine = worker->current;
+  coroutine->entry(coroutine->argument);
+
+  // never resumed again, the scheduler frees the stack once it's off it
+  coroutine->is_finished = 1;
+  switch_context(&coroutine->stack_pointer, worker->scheduler_stack_pointer);
+}
+
+static void make_ready(Worker *worker, Coroutine *coroutine) {
+  coroutine->next_ready = NULL;
+  if (worker->ready_tail)
+    worker->ready_tail->next_ready = coroutine;
+  else
+    worker->ready_head = coroutine;
+  worker->ready_tail = coroutine;
+}
+
+Coroutine *spawn_coroutine(Worker *worker, void (*entry)(void *),
+                           void *argument) {
+  Coroutine *coroutine = malloc(sizeof(Coroutine));
+  char *stack = take_stack(worker);
+  if (!coroutine || !stack) {
+    free(coroutine);
+    return NULL;
+  }
+
+  memset(coroutine, 0, sizeof(*coroutine));
+  coroutine->stack = stack;
+  coroutine->entry = entry;
+  coroutine->argument = argument;
+  coroutine->worker = worker;
+  coroutine->waiting_fd = -1;
+
+  // lay out a frame for switch_context to pop: zeroed callee saved registers
+  // and coroutine_main as the return address. on x86_64 the top slot stands in
+  // for the return address a call would have pushed, keeping the stack
+  // aligned the way coroutine_main expects
+  char *top = stack + GUARD_PAGE_SIZE + COROUTINE_STACK_SIZE;
+  void **frame = (void **)(top - SAVED_FRAME_SIZE);
+  memset(frame, 0, SAVED_FRAME_SIZE);
+#if defined(__x86_64__)
+  frame[6] = (void *)coroutine_main;
+#else
+  frame[11] = (void *)coroutine_main;
+#endif
+  coroutine->stack_pointer = frame;
+
+  worker->num_coroutines++;
+  make_ready(worker, coroutine);
+  return coroutine;
+}
+
+static void resume(Worker *worker, Coroutine *coroutine) {
+  worker->current = coroutine;
+  switch_context(&worker->scheduler_stack_pointer, coroutine->stack_pointer);
+  worker->current = NULL;
+
+  if (coroutine->is_finished) {
+    // a wakeup that hasn't been handled yet mustn't outlive the coroutine
+    pthread_mutex_lock(&worker->wake_mutex);
+    if (coroutine->wake_pending) {
+      Coroutine **link = &worker->wake_head;
+      while (*link != coroutine)
+        link = &(*link)->next_wake;
+      *link = coroutine->next_wake;
+    }
+    pthread_mutex_unlock(&worker->wake_mutex);
+
+    release_stack(worker, coroutine->stack);
+    free(coroutine);
+    worker->num_coroutines--;
+  }
+}
+
+void run_ready_coroutines(Worker *worker) {
+  current_worker = worker;
+  while (worker->ready_head) {
+    Coroutine *coroutine = worker->ready_head;
+    worker->ready_head = coroutine->next_ready;
+    if (!worker->ready_head)
+      worker->ready_tail = NULL;
+    resume(worker, coroutine);
+  }
+}
+
+static void suspend(Worker *worker) {
+  Coroutine *coroutine = worker->current;
+  switch_context(&coroutine->stack_pointer, worker->scheduler_stack_pointer);
+}
+
+// lets everything else that's ready run, then picks up where it left off
+void coroutine_yield() {
+  Worker *worker = current_worker;
+  if (!worker || !worker->current)
+    return;
+  make_ready(worker, worker->current);
+  suspend(worker);
+}
+
+Coroutine *current_coroutine() {
+  return current_worker ? current_worker->current : NULL;
+}
+
+// drops coroutine from the worker's deadline list, if it's on it
+static void forget_deadline(Worker *worker, Coroutine *coroutine) {
+  Coroutine **link = &worker->deadline_head;
+  while (*link && *link != coroutine)
+    link = &(*link)->next_deadline;
+  if (*link)
+    *link = coroutine->next_deadline;
+  coroutine->next_deadline = NULL;
+}
+
+// timeout is in milliseconds, -1 for none. a wait that times out comes back
+// with errno set to ETIMEDOUT
+static int park(Worker *worker, int fd, unsigned events, int is_wakeable,
+                int timeout) {
+  if (fd >= worker->waiting_capacity) {
+    int capacity = worker->waiting_capacity ? worker->waiting_capacity : 1024;
+    while (capacity <= fd)
+      capacity *= 2;
+    Coroutine **waiting =
+        realloc(worker->waiting, sizeof(Coroutine *) * capacity);
+    if (!waiting)
+      return -1;
+    memset(waiting + worker->waiting_capacity, 0,
+           sizeof(Coroutine *) * (capacity - worker->waiting_capacity));
+    worker->waiting = waiting;
+    worker->waiting_capacity = capacity;
+  }
+
+  // one shot, so an fd only ever wakes the coroutine that armed it. a
+  // registration outlives the wait and is re-armed next time, and closing
+  // the fd drops it
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.fd = fd;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+    if (errno != ENOENT ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+
+  Coroutine *coroutine = worker->current;
+  worker->waiting[fd] = coroutine;
+  coroutine->waiting_fd = fd;
+  coroutine->is_wakeable = is_wakeable;
+  coroutine->timed_out = 0;
+  if (timeout >= 0) {
+    coroutine->deadline =
+        monotonic_nanoseconds() + (uint64_t)timeout * 1000000;
+    coroutine->next_deadline = worker->deadline_head;
+    worker->deadline_head = coroutine;
+  }
+  suspend(worker);
+  coroutine->is_wakeable = 0;
+  if (timeout >= 0)
+    forget_deadline(worker, coroutine);
+  if (coroutine->timed_out) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+static int poll_fd(int fd, unsigned events, int timeout) {
+  struct pollfd poll_fd;
+  poll_fd.fd = fd;
+  poll_fd.events =
+      (events & EPOLLIN ? POLLIN : 0) | (events & EPOLLOUT ? POLLOUT : 0);
+  int ready = poll(&poll_fd, 1, timeout);
+  if (ready == 0)
+    errno = ETIMEDOUT;
+  return ready <= 0 ? -1 : 0;
+}
+
+// parks the running coroutine until fd is ready for events (EPOLLIN and/or
+// EPOLLOUT). outside a coroutine it just blocks in poll, so the same socket
+// code works on any thread
+int coroutine_wait_fd(int fd, unsigned events) {
+  Worker *worker = current_worker;
+  if (!worker || !worker->current)
+    return poll_fd(fd, events, -1);
+  return park(worker, fd, events, 0, -1);
+}
+
+// the same, but gives up after timeout milliseconds with errno ETIMEDOUT
+int coroutine_wait_fd_timeout(int fd, unsigned events, int timeout) {
+  Worker *worker = current_worker;
+  if (!worker || !worker->current)
+    return poll_fd(fd, events, timeout);
+  return park(worker, fd, events, 0, timeout);
+}
+
+// the same, but wake_coroutine also ends the wait. a wakeup that arrives while
+// the coroutine is running is dropped, so check whatever the wakeup is about
+// before waiting
+int coroutine_wait_fd_or_wake(int fd, unsigned events) {
+  Worker *worker = current_worker;
+  if (!worker || !worker->current)
+    return poll_fd(fd, events, -1);
+  return park(worker, fd, events, 1, -1);
+}
+
+// safe from any thread. only the first wakeup into an empty list writes
+// wake_fd, so waking many coroutines on one worker costs one syscall
+void wake_coroutine(Coroutine *coroutine) {
+  Worker *worker = coroutine->worker;
+  int was_empty = 0;
+
+  pthread_mutex_lock(&worker->wake_mutex);
+  if (!coroutine->wake_pending) {
+    was_empty = worker->wake_head == NULL;
+    coroutine->wake_pending = 1;
+    coroutine->next_wake = worker->wake_head;
+    worker->wake_head = coroutine;
+  }
+  pthread_mutex_unlock(&worker->wake_mutex);
+
+  if (was_empty) {
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) == -1)
+      perror("waking worker");
+  }
+}
+
+static void take_wakeups(Worker *worker) {
+  pthread_mutex_lock(&worker->wake_mutex);
+  Coroutine *coroutine = worker->wake_head;
+  worker->wake_head = NULL;
+  while (coroutine) {
+    Coroutine *next = coroutine->next_wake;
+    coroutine->wake_pending = 0;
+    coroutine->next_wake = NULL;
+
+    if (coroutine->is_wakeable && coroutine->waiting_fd != -1) {
+      worker->waiting[coroutine->waiting_fd] = NULL;
+      coroutine->waiting_fd = -1;
+      make_ready(worker, coroutine);
+    }
+    coroutine = next;
+  }
+  pthread_mutex_unlock(&worker->wake_mutex);
+}
+
+// how long epoll_wait can sleep before the nearest deadline, in milliseconds,
+// rounded up so the deadline has passed by the time it returns
+static int next_timeout(Worker *worker) {
+  if (!worker->deadline_head)
+    return -1;
+  uint64_t nearest = worker->deadline_head->deadline;
+  for (Coroutine *coroutine = worker->deadline_head; coroutine;
+       coroutine = coroutine->next_deadline)
+    if (coroutine->deadline < nearest)
+      nearest = coroutine->deadline;
+  uint64_t now = monotonic_nanoseconds();
+  return nearest <= now ? 0 : (int)((nearest - now + 999999) / 1000000);
+}
+
+// readies every coroutine still parked past its deadline. its fd stays armed,
+// but with nothing in waiting[fd] an event on it is ignored
+static void expire_deadlines(Worker *worker) {
+  uint64_t now = monotonic_nanoseconds();
+  for (Coroutine *coroutine = worker->deadline_head; coroutine;
+       coroutine = coroutine->next_deadline) {
+    if (coroutine->deadline > now || coroutine->waiting_fd == -1)
+      continue;
+    worker->waiting[coroutine->waiting_fd] = NULL;
+    coroutine->waiting_fd = -1;
+    coroutine->timed_out = 1;
+    make_ready(worker, coroutine);
+  }
+}
+
+static void run_task(void *argument) {
+  Task *task = argument;
+  current_worker->serve_task(task);
+  free(task);
+}
+
+static void take_new_tasks(Worker *worker) {
+  uint64_t wakeups;
+  while (read(worker->wake_fd, &wakeups, sizeof(wakeups)) > 0)
+    ;
+
+  pthread_mutex_lock(&worker->queue_mutex);
+  Task *tasks = worker->queue.head;
+  worker->queue = new_task_queue();
+  pthread_mutex_unlock(&worker->queue_mutex);
+
+  while (tasks) {
+    Task *task = tasks;
+    tasks = tasks->next;
+    task->next = NULL;
+    if (!spawn_coroutine(worker, run_task, task)) {
+      fprintf(stderr, "no coroutine for socket %d, dropping it\n",
+              task->socket);
+      close(task->socket);
+      free(task);
+    }
+  }
+}
+
+// each request is a coroutine running serve_request as straight line code.
+// whenever a socket would block it parks here until epoll says the fd is
+// ready, and the worker gets on with the other requests meanwhile
+void *run_worker(void *args) {
+  Worker *worker = args;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+
+  while (1) {
+    run_ready_coroutines(worker);
+
+    int num_events = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS,
+                                next_timeout(worker));
+    if (num_events == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      int fd = events[i].data.fd;
+      if (fd == worker->wake_fd) {
+        take_new_tasks(worker);
+        take_wakeups(worker);
+        continue;
+      }
+
+      Coroutine *coroutine =
+          fd < worker->waiting_capacity ? worker->waiting[fd] : NULL;
+      if (!coroutine)
+        continue;
+      worker->waiting[fd] = NULL;
+      coroutine->waiting_fd = -1;
+      make_ready(worker, coroutine);
+    }
+    if (worker->deadline_head)
+      expire_deadlines(worker);
+  }
+
+  return NULL;
+}
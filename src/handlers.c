@@ -0,0 +1,373 @@
+#include "http_server.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static HandlerRoute handler_routes[MAX_HANDLER_ROUTES];
+static int handler_route_count = 0;
+
+// /api matches /api and /api/users but not /apiary
+int route_matches(const char *prefix, unsigned prefix_length, const char *path,
+                  unsigned path_length) {
+  if (prefix_length > path_length || memcmp(path, prefix, prefix_length) != 0)
+    return 0;
+  return prefix_length == path_length || prefix[prefix_length - 1] == '/' ||
+         path[prefix_length] == '/';
+}
+
+// routes is an array of count route structs, route_size bytes apart, that
+// each start with their RoutePrefix. returns the index of the longest prefix
+// matching path, or -1
+int longest_route_match(const void *routes, int count, unsigned long route_size,
+                        const char *path, unsigned path_length) {
+  int best = -1;
+  unsigned best_length = 0;
+
+  for (int i = 0; i < count; i++) {
+    const RoutePrefix *prefix =
+        (const RoutePrefix *)((const char *)routes + i * route_size);
+    if (!route_matches(prefix->path, prefix->length, path, path_length))
+      continue;
+    if (best == -1 || prefix->length > best_length) {
+      best = i;
+      best_length = prefix->length;
+    }
+  }
+
+  return best;
+}
+
+// handlers are registered before the server starts accepting, either from
+// main or from a module's tuke_register_handlers, so the table is read only
+// by the time workers look at it
+int register_handler(const char *prefix, RequestHandler handler,
+                     void *user_data) {
+  if (prefix[0] != '/') {
+    fprintf(stderr, "handler route %s should start with /\n", prefix);
+    return -1;
+  }
+  if (handler_route_count == MAX_HANDLER_ROUTES) {
+    fprintf(stderr, "too many handler routes\n");
+    return -1;
+  }
+
+  HandlerRoute route;
+  route.prefix.path = strdup(prefix);
+  route.prefix.length = strlen(prefix);
+  route.handler = handler;
+  route.user_data = user_data;
+  handler_routes[handler_route_count++] = route;
+  return 0;
+}
+
+// handler_module <path to shared object>
+int load_handler_module(int argc, char **argv) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: handler_module path/to/module.so\n");
+    return -1;
+  }
+
+  void *module = dlopen(argv[0], RTLD_NOW | RTLD_LOCAL);
+  if (!module) {
+    fprintf(stderr, "dlopen: %s\n", dlerror());
+    return -1;
+  }
+
+  RegisterHandlersFunction register_handlers =
+      (RegisterHandlersFunction)dlsym(module, REGISTER_HANDLERS_SYMBOL);
+  if (!register_handlers) {
+    fprintf(stderr, "%s has no %s\n", argv[0], REGISTER_HANDLERS_SYMBOL);
+    dlclose(module);
+    return -1;
+  }
+
+  // the module stays loaded for the life of the server
+  return register_handlers();
+}
+
+HandlerRoute *find_handler_route(const char *path, unsigned path_length) {
+  int index = longest_route_match(handler_routes, handler_route_count,
+                                  sizeof(HandlerRoute), path, path_length);
+  return index == -1 ? NULL : &handler_routes[index];
+}
+
+void response_set_status(ResponseWriter *response, int status) {
+  response->status = status;
+}
+
+void response_set_content_length(ResponseWriter *response, long length) {
+  response->content_length = length;
+}
+
+int response_add_header(ResponseWriter *response, const char *name,
+                        const char *value) {
+  if (response->headers_sent) {
+    fprintf(stderr, "header %s added after the response started\n", name);
+    return -1;
+  }
+
+  unsigned available = RESPONSE_HEADERS_LENGTH - response->headers_length;
+  int written = snprintf(response->headers + response->headers_length,
+                         available, "%s: %s\r\n", name, value);
+  if (written < 0 || written >= available) {
+    fprintf(stderr, "response headers too large\n");
+    return -1;
+  }
+
+  response->headers_length += written;
+  return 0;
+}
+
+// an HTTP/1.1 client can take a chunked body, so a response that doesn't know
+// its length up front can still start streaming right away
+void init_response_writer(ResponseWriter *response, int socket,
+                          const HTTP_Request *request) {
+  response->socket = socket;
+  response->status = 200;
+  response->content_length = -1;
+  response->headers_sent = 0;
+  response->headers_length = 0;
+  response->can_chunk = request->request_line.http_major == 1 &&
+                        request->request_line.http_minor >= 1;
+  response->is_chunked = 0;
+  response->body_sent = 0;
+  response->is_finished = 0;
+}
+
+static int check_length(ResponseWriter *response, long length) {
+  if (response->content_length >= 0 &&
+      response->body_sent + length > response->content_length) {
+    fprintf(stderr, "response body is longer than its Content-Length\n");
+    return -1;
+  }
+  response->body_sent += length;
+  return 0;
+}
+
+// sends the status line and headers together with the first piece of body, so
+// a small response goes out in a single write
+static int send_with_headers(ResponseWriter *response, const char *data,
+                             long length) {
+  response->is_chunked = response->content_length < 0 && response->can_chunk;
+
+  // chunked is HTTP/1.1 only. the connection still closes after every
+  // response, so say so
+  char status_line[64];
+  int status_length =
+      snprintf(status_line, sizeof(status_line), "HTTP/1.%d %d\r\n",
+               response->is_chunked, response->status);
+
+  char framing[64];
+  int framing_length = 0;
+  if (response->content_length >= 0)
+    framing_length = snprintf(framing, sizeof(framing),
+                              "Content-Length: %ld\r\n",
+                              response->content_length);
+  else if (response->is_chunked)
+    framing_length =
+        snprintf(framing, sizeof(framing),
+                 "Transfer-Encoding: chunked\r\nConnection: close\r\n");
+
+  char chunk_size[24];
+  int chunk_size_length = 0;
+  if (response->is_chunked && length > 0)
+    chunk_size_length =
+        snprintf(chunk_size, sizeof(chunk_size), "%lx\r\n", length);
+
+  struct iovec spans[7] = {
+      {status_line, status_length},
+      {response->headers, response->headers_length},
+      {framing, framing_length},
+      {(void *)"\r\n", 2},
+      {chunk_size, chunk_size_length},
+      {(void *)data, length},
+      {(void *)"\r\n", chunk_size_length ? 2 : 0},
+  };
+  response->headers_sent = 1;
+  return writev_all(response->socket, spans, 7);
+}
+
+// body bytes are sent as they're written, nothing is held back. when the
+// client reads slower than the handler writes, the write parks the coroutine
+// until the socket drains, so the handler is paused instead of anything piling
+// up in memory
+int response_write(ResponseWriter *response, const char *data, long length) {
+  if (check_length(response, length) == -1)
+    return -1;
+  if (!response->headers_sent)
+    return send_with_headers(response, data, length);
+
+  if (length == 0)
+    return 0;
+
+  if (response->is_chunked) {
+    char chunk_size[24];
+    int chunk_size_length =
+        snprintf(chunk_size, sizeof(chunk_size), "%lx\r\n", length);
+    struct iovec spans[3] = {
+        {chunk_size, chunk_size_length},
+        {(void *)data, length},
+        {(void *)"\r\n", 2},
+    };
+    return writev_all(response->socket, spans, 3);
+  }
+
+  long sent_bytes;
+  return send_all(response->socket, data, length, &sent_bytes);
+}
+
+static int send_file_body(ResponseWriter *response, int file, off_t offset,
+                          long length) {
+  if (!response->headers_sent && send_with_headers(response, NULL, 0) == -1)
+    return -1;
+
+  long sent_bytes;
+  char chunk_size[24];
+  if (response->is_chunked && length > 0) {
+    int chunk_size_length =
+        snprintf(chunk_size, sizeof(chunk_size), "%lx\r\n", length);
+    if (send_all(response->socket, chunk_size, chunk_size_length,
+                 &sent_bytes) == -1)
+      return -1;
+  }
+
+  long remaining = length;
+  while (remaining > 0) {
+    long sent = co_sendfile(response->socket, file, &offset, remaining);
+    if (sent == -1) {
+      perror("sendfile");
+      return -1;
+    }
+    // the file got shorter underneath us
+    if (sent == 0)
+      return -1;
+    remaining -= sent;
+  }
+
+  if (response->is_chunked && length > 0)
+    return send_all(response->socket, "\r\n", 2, &sent_bytes);
+  return 0;
+}
+
+// length bytes of file from offset, sendfile'd so they never pass through
+// memory here
+int response_send_file(ResponseWriter *response, int file, off_t offset,
+                       long length) {
+  if (check_length(response, length) == -1)
+    return -1;
+
+  cork_connection(response->socket);
+  int status = send_file_body(response, file, offset, length);
+  uncork_connection(response->socket);
+  return status;
+}
+
+int response_finish(ResponseWriter *response) {
+  if (response->is_finished)
+    return 0;
+  response->is_finished = 1;
+
+  // nothing was written, so the length is known after all
+  if (!response->headers_sent) {
+    if (response->content_length < 0)
+      response->content_length = 0;
+    if (send_with_headers(response, NULL, 0) == -1)
+      return -1;
+  }
+
+  if (response->is_chunked) {
+    long sent_bytes;
+    return send_all(response->socket, "0\r\n\r\n", 5, &sent_bytes);
+  }
+  if (response->content_length >= 0 &&
+      response->body_sent < response->content_length) {
+    fprintf(stderr, "response ended %ld bytes short of its Content-Length\n",
+            response->content_length - response->body_sent);
+    return -1;
+  }
+  return 0;
+}
+
+// the body bytes that came in with the headers are handed out first, so a
+// handler reading the whole body doesn't have to look at request->body too.
+// returns 0 at the end of the body and -1 if it can't be read, like a client
+// closing early or a chunked body
+long request_read(const HandlerRequest *request, char *buffer, long length) {
+  BodyReader *reader = request->body_reader;
+  if (reader->remaining == -1) {
+    fprintf(stderr, "only Content-Length request bodies can be read\n");
+    return -1;
+  }
+
+  if (reader->buffered_length) {
+    unsigned taken =
+        length < reader->buffered_length ? length : reader->buffered_length;
+    memcpy(buffer, reader->buffered, taken);
+    reader->buffered += taken;
+    reader->buffered_length -= taken;
+    return taken;
+  }
+
+  if (reader->remaining == 0)
+    return 0;
+  long received = co_recv(reader->socket, buffer,
+                          length < reader->remaining ? length
+                                                     : reader->remaining,
+                          0);
+  if (received <= 0)
+    return -1;
+  reader->remaining -= received;
+  return received;
+}
+
+static void init_body_reader(BodyReader *reader, int socket,
+                             const HTTP_Request *request, const char *body,
+                             unsigned buffered) {
+  reader->socket = socket;
+  reader->buffered = body;
+  reader->buffered_length = 0;
+  reader->remaining = -1;
+  if (find_header(request, "Transfer-Encoding"))
+    return;
+
+  const Header *header = find_header(request, "Content-Length");
+  long content_length = header ? strtol(header->body_string, NULL, 10) : 0;
+  if (content_length < 0)
+    return;
+  // anything past the body would be a pipelined request
+  reader->buffered_length =
+      buffered < content_length ? buffered : content_length;
+  reader->remaining = content_length - reader->buffered_length;
+}
+
+int run_handler(int client_socket, HandlerRoute *route,
+                const HTTP_Request *request, const char *raw,
+                unsigned raw_length) {
+  HandlerRequest handler_request;
+  BodyReader body_reader;
+  handler_request.http = request;
+  handler_request.body = raw + request->header_bytes;
+  handler_request.body_length = raw_length - request->header_bytes;
+  init_body_reader(&body_reader, client_socket, request, handler_request.body,
+                   handler_request.body_length);
+  handler_request.body_reader = &body_reader;
+  handler_request.user_data = route->user_data;
+
+  ResponseWriter response;
+  init_response_writer(&response, client_socket, request);
+
+  if (route->handler(&handler_request, &response) == -1) {
+    if (response.headers_sent)
+      return -1;
+    response.status = 500;
+    response.content_length = 0;
+    response.headers_length = 0;
+    response.body_sent = 0;
+    response.is_finished = 0;
+  }
+
+  return response_finish(&response);
+}
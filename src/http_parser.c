@@ -3,11 +3,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #define MAX_HEADERS 50
 
-const char *current_location;
-const char *beginning_of_current;
+// thread local so that worker threads can parse requests concurrently
+__thread const char *current_location;
+__thread const char *beginning_of_current;
 
 int expect_and_skip_char(char c) {
   if (c != *current_location++)
@@ -95,8 +97,18 @@ static int is_unreserved() {
           is_safe() || is_extra());
 }
 
-// Missing escape
-static int is_uchar() { return is_unreserved(); }
+static int is_hex(char c) {
+  return is_numeric(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// escape: "%" hex hex
+// the hex digits are unreserved, so only the % needs checking here
+static int is_escape() {
+  return *current_location == '%' && is_hex(current_location[1]) &&
+         is_hex(current_location[2]);
+}
+
+static int is_uchar() { return is_unreserved() || is_escape(); }
 
 static int is_pchar() {
   char c = *current_location;
@@ -332,5 +344,56 @@ HTTP_Request parse_http_request(const char *text) {
   printf("about to parse headers, at\n%s", current_location);
 #endif
   parse_headers(&request);
+  request.header_bytes = current_location - text;
   return request;
 }
+
+// header names are case insensitive
+const Header *find_header(const HTTP_Request *request, const char *name) {
+  unsigned length = strlen(name);
+  for (unsigned i = 0; i < request->num_headers; i++) {
+    const Header *header = &request->headers[i];
+    if (header->header_length == length &&
+        strncasecmp(header->header_string, name, length) == 0)
+      return header;
+  }
+  return NULL;
+}
+
+// whether token appears anywhere in the header's value, ignoring case. header
+// can be NULL, for a header the request didn't have
+int header_has_token(const Header *header, const char *token) {
+  if (!header)
+    return 0;
+  unsigned length = strlen(token);
+  for (unsigned i = 0; i + length <= header->body_length; i++) {
+    if (strncasecmp(header->body_string + i, token, length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// steps through a comma separated header value like "gzip, br;q=0.5". each
+// call points element at the next non empty element, parameters and all,
+// with the whitespace around it trimmed. returns 0 once *cursor reaches end
+int next_list_element(const char **cursor, const char *end,
+                      const char **element, unsigned *length) {
+  while (*cursor < end) {
+    const char *start = *cursor;
+    const char *comma = memchr(start, ',', end - start);
+    const char *stop = comma ? comma : end;
+    *cursor = comma ? comma + 1 : end;
+
+    while (start < stop && (*start == ' ' || *start == '\t'))
+      start++;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+      stop--;
+    if (stop == start)
+      continue;
+
+    *element = start;
+    *length = stop - start;
+    return 1;
+  }
+  return 0;
+}
@@ -1,7 +1,33 @@
 #pragma once
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define NUM_THREADS 2
+#define COROUTINE_STACK_SIZE (64 * 1024)
+#define MAX_POOLED_STACKS 1024
+#define MAX_EPOLL_EVENTS 64
+#define MAX_PROXY_ROUTES 16
+#define MAX_PROXY_BACKENDS 32
+#define MAX_BACKENDS_PER_ROUTE 8
+#define MAX_HANDLER_ROUTES 32
+#define RESPONSE_HEADERS_LENGTH 1024
+
+#define MAX_WEBSOCKET_ROUTES 16
+#define WEBSOCKET_QUEUE_LENGTH 256
+#define WEBSOCKET_MAX_FRAME (64 * 1024)
+#define WEBSOCKET_MAX_MESSAGE (1024 * 1024)
+
+#define ASSET_BUNDLE_MAGIC "TUKEBNDL"
+#define ASSET_BUNDLE_VERSION 2
+#define ASSET_PAGE_SIZE 4096
+#define ASSET_ETAG_LENGTH 24
+
+#define CAPTURE_MAGIC "TUKECAPT"
+#define CAPTURE_VERSION 3
+#define CAPTURE_BUFFER_LENGTH (4 * 1024 * 1024)
 
 typedef struct {
   int is_valid;
@@ -48,6 +74,9 @@ typedef struct {
   RequestLine request_line;
   Header *headers;
   unsigned num_headers;
+  // bytes from the start of the request text through the blank line that
+  // ends the headers
+  unsigned header_bytes;
   int is_valid;
 } HTTP_Request;
 
@@ -55,30 +84,456 @@ typedef struct Task {
   struct Task *next;
   int socket;
   const char *request;
+  // 0 when requests aren't being timed
+  uint64_t accepted_at;
 } Task;
 
+// the stages of a request, in the order they happen
+enum {
+  STAGE_ACCEPTED,
+  STAGE_DEQUEUED,
+  STAGE_RECEIVED,
+  STAGE_PARSED,
+  STAGE_OPENED,
+  STAGE_SENT,
+  NUM_STAGES
+};
+
+// monotonic nanoseconds at each stage, 0 for any the request skipped
+typedef struct {
+  int socket;
+  int is_long_lived;
+  int is_timed;
+  uint64_t at[NUM_STAGES];
+  char path[64];
+} RequestSpan;
+
 typedef struct {
   Task *head;
   Task *tail;
   int size;
 } TaskQueue;
 
+// stack_pointer is where switch_context left the stack while the coroutine
+// isn't running. stack is the bottom of its mapping, guard page included
+// waiting_fd is the fd it's parked on, or -1. wake_pending and next_wake
+// belong to the worker's wake_mutex
+typedef struct Coroutine {
+  void *stack_pointer;
+  char *stack;
+  void (*entry)(void *);
+  void *argument;
+  int is_finished;
+  struct Coroutine *next_ready;
+  struct Worker *worker;
+
+  int waiting_fd;
+  int is_wakeable;
+  int wake_pending;
+  struct Coroutine *next_wake;
+
+  // set while parked with a timeout, on the worker's deadline list
+  uint64_t deadline;
+  int timed_out;
+  struct Coroutine *next_deadline;
+
+  // the client connection being captured, if capture is on
+  struct CapturedConnection *capture;
+} Coroutine;
+
+// one event loop thread. tasks arrive on queue from the accepting thread, and
+// wakeups for parked coroutines on wake_head from any thread. both write
+// wake_fd to get the loop's attention. everything else is only touched by the
+// worker's own thread
+typedef struct Worker {
+  pthread_t thread;
+  int index;
+  int epoll_fd;
+  int wake_fd;
+  pthread_mutex_t queue_mutex;
+  TaskQueue queue;
+  void (*serve_task)(Task *);
+  pthread_mutex_t wake_mutex;
+  Coroutine *wake_head;
+
+  void *scheduler_stack_pointer;
+  Coroutine *current;
+  Coroutine *ready_head;
+  Coroutine *ready_tail;
+  // indexed by fd, the coroutine parked waiting on it
+  Coroutine **waiting;
+  int waiting_capacity;
+  // coroutines parked with a timeout. only connects use one, so it's short
+  Coroutine *deadline_head;
+  char **free_stacks;
+  int num_free_stacks;
+  int num_coroutines;
+} Worker;
+
 typedef struct {
-  pthread_t threads[NUM_THREADS];
+  Worker workers[NUM_THREADS];
+  unsigned next_worker;
 } ThreadPool;
 
+// walks a query string or params one key=value at a time, without copying
+typedef struct {
+  const char *next;
+  const char *end;
+  char separator;
+  int plus_is_space;
+} QueryIterator;
+
+// key and value point into the request buffer and are still percent encoded,
+// run them through percent_decode if they're needed decoded
+typedef struct {
+  const char *key;
+  unsigned key_length;
+  const char *value;
+  unsigned value_length;
+  int plus_is_space;
+} QueryParam;
+
+// every kind of route starts with one of these, so one longest prefix search
+// works for all of them
+typedef struct {
+  char *path;
+  unsigned length;
+} RoutePrefix;
+
+// reads a Content-Length body, the bytes that came in with the headers first
+// and then the rest off the socket
+typedef struct {
+  int socket;
+  const char *buffered;
+  unsigned buffered_length;
+  // bytes still to come off the socket, -1 if the body isn't framed by
+  // Content-Length
+  long remaining;
+} BodyReader;
+
+typedef struct {
+  const HTTP_Request *http;
+  // whatever part of the body arrived with the headers
+  const char *body;
+  unsigned body_length;
+  // all of the body, through request_read
+  BodyReader *body_reader;
+  void *user_data;
+} HandlerRequest;
+
+// content_length is -1 until set. a body of unknown length is chunked for
+// HTTP/1.1 clients, and ends when the connection closes for HTTP/1.0 ones.
+// headers go out with the first write, and nothing is buffered after that
+typedef struct {
+  int socket;
+  int status;
+  long content_length;
+  int headers_sent;
+  char headers[RESPONSE_HEADERS_LENGTH];
+  unsigned headers_length;
+
+  int can_chunk;
+  int is_chunked;
+  long body_sent;
+  int is_finished;
+} ResponseWriter;
+
+// return -1 to have the server answer 500, if nothing was written yet
+typedef int (*RequestHandler)(const HandlerRequest *, ResponseWriter *);
+
+// shared objects loaded with the handler_module directive export this, and
+// call register_handler from it
+#define REGISTER_HANDLERS_SYMBOL "tuke_register_handlers"
+typedef int (*RegisterHandlersFunction)();
+
+typedef struct {
+  RoutePrefix prefix;
+  RequestHandler handler;
+  void *user_data;
+} HandlerRoute;
+
+// capture log layout, written by the server with the capture directive and
+// read by tools/replay_capture.c
+// header | records, each followed by length bytes of data for CAPTURE_DATA.
+// records from different connections interleave roughly in time order
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  // CLOCK_REALTIME nanoseconds when capture started
+  uint64_t started_at;
+} CaptureHeader;
+
+enum {
+  CAPTURE_OPEN = 1,
+  CAPTURE_DATA,
+  CAPTURE_END,
+  CAPTURE_CLOSE,
+  CAPTURE_DROPPED
+};
+
+// timestamp is nanoseconds since capture started. OPEN is the accept, DATA is
+// bytes as the server read them, CLOSE is the server reading EOF because the
+// client shut its side, END is the connection finishing. for END, status is
+// the response's and length is how many bytes went back. DROPPED comes just
+// before END when some of the connection's records didn't fit in the buffer
+typedef struct {
+  uint64_t timestamp;
+  uint64_t connection;
+  uint32_t length;
+  uint16_t type;
+  uint16_t status;
+} CaptureRecord;
+
+typedef struct CapturedConnection {
+  uint64_t id;
+  int socket;
+  int status;
+  uint64_t sent_bytes;
+  int saw_close;
+  // a record was dropped, so the rest aren't worth keeping either
+  int is_incomplete;
+} CapturedConnection;
+
+// asset bundle layout, written by tools/pack_assets.c and mmap'd by the server
+// header | entries sorted by path | paths and response headers | bodies
+// bodies start on page boundaries so each can be sent straight from the file.
+// every offset is from the start of the file
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_assets;
+  uint64_t entries_offset;
+  uint64_t file_size;
+} AssetBundleHeader;
+
+typedef struct {
+  uint64_t path_offset;
+  uint32_t path_length;
+
+  // the whole response head, status line through the blank line
+  uint32_t headers_length;
+  uint64_t headers_offset;
+  uint64_t body_offset;
+  uint64_t body_length;
+
+  // gzip variant, gzip_body_length is 0 when there isn't one
+  uint32_t gzip_headers_length;
+  uint32_t padding;
+  uint64_t gzip_headers_offset;
+  uint64_t gzip_body_offset;
+  uint64_t gzip_body_length;
+
+  // quoted, nul terminated. the gzip variant has its own, since it's
+  // different bytes
+  char etag[ASSET_ETAG_LENGTH];
+  char gzip_etag[ASSET_ETAG_LENGTH];
+} AssetEntry;
+
+enum {
+  WEBSOCKET_CONTINUATION = 0x0,
+  WEBSOCKET_TEXT = 0x1,
+  WEBSOCKET_BINARY = 0x2,
+  WEBSOCKET_CLOSE = 0x8,
+  WEBSOCKET_PING = 0x9,
+  WEBSOCKET_PONG = 0xA
+};
+
+// a serialized frame. a broadcast builds one and every subscriber's queue
+// points at it, the last one to send it frees it
+typedef struct {
+  int references;
+  long length;
+  char data[];
+} SharedFrame;
+
+struct WebSocketRoute;
+
+// queue is a ring of frames waiting to go out, sent from queue_offset bytes
+// into the first one. mutex guards the queue, since any thread can add to it
+typedef struct WebSocket {
+  int socket;
+  Coroutine *coroutine;
+  struct WebSocketRoute *route;
+
+  pthread_mutex_t mutex;
+  SharedFrame *queue[WEBSOCKET_QUEUE_LENGTH];
+  unsigned queue_head;
+  unsigned queue_length;
+  long queue_offset;
+  int is_closing;
+  int is_overflowing;
+
+  // the rest is only touched by the connection's own coroutine
+  char *input;
+  unsigned input_length;
+  unsigned input_capacity;
+  char *message;
+  unsigned long message_length;
+  int message_opcode;
+
+  struct WebSocket *next_subscriber;
+  struct WebSocket *previous_subscriber;
+} WebSocket;
+
+// called with each whole message, after unmasking and reassembly
+typedef void (*WebSocketHandler)(WebSocket *websocket, int opcode,
+                                 const char *payload, unsigned long length,
+                                 void *user_data);
+
+// every connection to a route is one of its subscribers
+typedef struct WebSocketRoute {
+  RoutePrefix prefix;
+  WebSocketHandler on_message;
+  void *user_data;
+
+  pthread_mutex_t mutex;
+  WebSocket *subscribers;
+  int num_subscribers;
+} WebSocketRoute;
+
+// an upstream server, either host:port over TCP or unix:/path
+typedef struct {
+  int is_unix;
+  char *host;
+  char *port;
+  char *unix_path;
+
+  int healthy;
+  int outstanding;
+} Backend;
+
+typedef struct {
+  RoutePrefix prefix;
+  int backends[MAX_BACKENDS_PER_ROUTE];
+  int num_backends;
+} ProxyRoute;
+
 // sockets
 int get_socket();
 int accept_connection(int socket_descriptor);
 int send_all(int receiving_socket, const char *buffer, long bytes_to_send,
              long *bytes_sent);
+int writev_all(int receiving_socket, struct iovec *spans, int count);
+long co_recv(int socket, void *buffer, long length, int flags);
+long co_send(int socket, const void *buffer, long length, int flags);
+long co_sendfile(int socket, int file, off_t *offset, long length);
+int co_connect(int socket, const struct sockaddr *address, socklen_t length,
+               int timeout);
+
+// socket tuning
+int set_socket_option(int argc, char **argv);
+int connection_cpu(int socket);
+int is_steering_connections();
+void cork_connection(int socket);
+void uncork_connection(int socket);
 
 // parsing
 HTTP_Request parse_http_request(const char *);
+const Header *find_header(const HTTP_Request *request, const char *name);
+int header_has_token(const Header *header, const char *token);
+int next_list_element(const char **cursor, const char *end,
+                      const char **element, unsigned *length);
+
+// config
+int load_config(const char *path);
+
+// routing
+int route_matches(const char *prefix, unsigned prefix_length, const char *path,
+                  unsigned path_length);
+int longest_route_match(const void *routes, int count, unsigned long route_size,
+                        const char *path, unsigned path_length);
+
+// query strings
+QueryIterator iterate_query(const RelativePath *relative_path);
+QueryIterator iterate_params(const RelativePath *relative_path);
+int next_query_param(QueryIterator *iterator, QueryParam *param);
+int query_param_is(const QueryParam *param, const char *key);
+long percent_decode(const char *encoded, unsigned length, char *decoded,
+                    int plus_is_space);
+
+// handlers
+int register_handler(const char *prefix, RequestHandler handler,
+                     void *user_data);
+int load_handler_module(int argc, char **argv);
+HandlerRoute *find_handler_route(const char *path, unsigned path_length);
+int run_handler(int client_socket, HandlerRoute *route,
+                const HTTP_Request *request, const char *raw,
+                unsigned raw_length);
+void init_response_writer(ResponseWriter *response, int socket,
+                          const HTTP_Request *request);
+void response_set_status(ResponseWriter *response, int status);
+void response_set_content_length(ResponseWriter *response, long length);
+int response_add_header(ResponseWriter *response, const char *name,
+                        const char *value);
+int response_write(ResponseWriter *response, const char *data, long length);
+int response_send_file(ResponseWriter *response, int file, off_t offset,
+                       long length);
+int response_finish(ResponseWriter *response);
+long request_read(const HandlerRequest *request, char *buffer, long length);
+
+// websockets
+int register_websocket_route(const char *prefix, WebSocketHandler on_message,
+                             void *user_data);
+int add_websocket_broadcast_route(int argc, char **argv);
+WebSocketRoute *find_websocket_route(const char *path, unsigned path_length);
+int serve_websocket(int client_socket, WebSocketRoute *route,
+                    const HTTP_Request *request, const char *raw,
+                    unsigned raw_length);
+int websocket_send(WebSocket *websocket, int opcode, const char *payload,
+                   unsigned long length);
+void websocket_broadcast(WebSocketRoute *route, int opcode,
+                         const char *payload, unsigned long length);
+void websocket_unmask(char *payload, unsigned long length,
+                      const unsigned char *key);
+
+// asset bundle
+int open_asset_bundle(int argc, char **argv);
+const AssetEntry *find_asset(const char *path, unsigned path_length);
+int serve_asset(int client_socket, const AssetEntry *asset,
+                const HTTP_Request *request);
+
+// reverse proxy
+int add_proxy_route(int argc, char **argv);
+ProxyRoute *find_proxy_route(const char *path, unsigned path_length);
+int proxy_request(int client_socket, ProxyRoute *route,
+                  const HTTP_Request *request, const char *raw,
+                  unsigned raw_length);
+void start_proxy_health_checks();
+
+// capture
+int open_capture(int argc, char **argv);
+void start_capture(int socket, uint64_t accepted_at);
+void capture_received(int socket, const void *data, long length);
+void capture_sent(int socket, const void *data, long length);
+void finish_capture();
+
+// tracing
+uint64_t monotonic_nanoseconds();
+int set_slow_request_threshold(int argc, char **argv);
+int is_timing_requests();
+void start_span(RequestSpan *span, const Task *task);
+void trace_stage(RequestSpan *span, int stage);
+void trace_path(RequestSpan *span, const char *path, unsigned length);
+void finish_span(RequestSpan *span);
 
 // task queue
 TaskQueue new_task_queue();
 Task *new_task(int socket);
 void enqueue_task(TaskQueue *, Task *);
 Task *dequeue_task(TaskQueue *queue);
-ThreadPool new_thread_pool(void *start_thread, TaskQueue *);
+void start_thread_pool(ThreadPool *pool, void (*serve_task)(Task *));
+void submit_task(ThreadPool *pool, Task *task);
+
+// coroutines
+void init_worker(Worker *worker, int index, void (*serve_task)(Task *));
+void *run_worker(void *worker);
+Coroutine *spawn_coroutine(Worker *worker, void (*entry)(void *),
+                           void *argument);
+void run_ready_coroutines(Worker *worker);
+void coroutine_yield();
+int coroutine_wait_fd(int fd, unsigned events);
+int coroutine_wait_fd_or_wake(int fd, unsigned events);
+int coroutine_wait_fd_timeout(int fd, unsigned events, int timeout);
+Coroutine *current_coroutine();
+void wake_coroutine(Coroutine *coroutine);
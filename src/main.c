@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include "http_server.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/wait.h>
 
@@ -10,21 +12,22 @@
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define BUFFER_LENGTH (4096)
-#define MAX_ATTEMPTS (5)
+#define CONFIG_PATH "tuke.conf"
 #define TUKE_DEBUG
 
-pthread_mutex_t queue_mutex;
-pthread_cond_t queue_condition;
+static ThreadPool thread_pool;
 
 void send_400_response(int accepted_socket) {
   long sent_bytes;
   const char *message = "HTTP/1.0 400\r\n";
   int message_length = 14;
-  if ((sent_bytes = send(accepted_socket, message, message_length, 0)) == -1) {
+  if (send_all(accepted_socket, message, message_length, &sent_bytes) == -1) {
     perror("sent -1 bytes on file_to_send");
   }
   close(accepted_socket);
@@ -37,55 +40,24 @@ void sigchld_handler(int s) {
   errno = saved_errno;
 }
 
-static char *read_file(const char *path, long *size) {
-  printf("trying to open file: %s\n", path);
-  FILE *file = fopen(path, "r");
-  if (!file) {
-    perror("failed to open file to read");
-    return NULL;
-  }
-
-  fseek(file, 0L, SEEK_END);
-  long file_size = ftell(file);
-  rewind(file);
-
-  char *buffer = malloc(file_size + 1);
-  if (!buffer) {
-    perror("failed to malloc");
-    return NULL;
-  }
-
-  long bytes_read = fread(buffer, sizeof(char), file_size, file);
-  if (bytes_read < file_size) {
-    perror("failed to fread");
-    return NULL;
-  }
-
-  buffer[file_size] = '\0';
-  *size = file_size;
-  fclose(file);
-  return buffer;
-}
-
-void serve_request(Task *task) {
-  uint64_t tid;
-  pthread_threadid_np(NULL, &tid);
-  printf("thread %llu sleeping\n", tid);
-  sleep(1);
-  int accepted_socket = task->socket;
+static void handle_request(int accepted_socket, RequestSpan *span) {
+  long tid = syscall(SYS_gettid);
 
   char buffer[BUFFER_LENGTH];
 
-  printf("thread %llu recv'ing\n", tid);
-  unsigned received_bytes = recv(accepted_socket, buffer, BUFFER_LENGTH, 0);
+  printf("thread %ld recv'ing\n", tid);
+  unsigned received_bytes =
+      co_recv(accepted_socket, buffer, BUFFER_LENGTH - 1, 0);
   if (received_bytes == -1 || received_bytes > BUFFER_LENGTH) {
     perror("received -1 bytes");
     send_400_response(accepted_socket);
     return;
   }
   buffer[received_bytes] = '\0';
+  trace_stage(span, STAGE_RECEIVED);
 
   HTTP_Request request = parse_http_request(buffer);
+  trace_stage(span, STAGE_PARSED);
   if (!request.is_valid) {
     send_400_response(accepted_socket);
     free(request.headers);
@@ -110,26 +82,14 @@ void serve_request(Task *task) {
          request_line.relative_path.query);
 #endif
 
-  const char *query_key = request_line.relative_path.query;
-  unsigned key_length = request_line.relative_path.query_length;
-  const char *query_value = NULL;
-  unsigned value_length = 0;
-  if (request_line.relative_path.query_length) {
-    for (unsigned i = 0; i < request_line.relative_path.query_length; ++i) {
-      if (request_line.relative_path.query[i] == '=') {
-        key_length = i;
-        query_value = query_key + i + 1;
-        value_length = request_line.relative_path.query_length - key_length - 1;
-      }
-    }
 #ifdef TUKE_DEBUG
-    printf("Got query with key %.*s and value %.*s\n", key_length, query_key,
-           value_length, query_value);
-#endif
+  QueryIterator query = iterate_query(&request_line.relative_path);
+  QueryParam param;
+  while (next_query_param(&query, &param)) {
+    printf("Got query with key %.*s and value %.*s\n", param.key_length,
+           param.key, param.value_length, param.value);
   }
-
-  long sent_bytes;
-  unsigned message_length = 0;
+#endif
 
   if (!request_line.is_valid) {
     fprintf(stderr, "invalid request line, responding 400\n");
@@ -137,6 +97,56 @@ void serve_request(Task *task) {
     free(request.headers);
     return;
   }
+  trace_path(span, url, request_line.relative_path.path_length);
+
+  WebSocketRoute *websocket_route =
+      find_websocket_route(url, request_line.relative_path.path_length);
+  if (websocket_route) {
+    span->is_long_lived = 1;
+    if (serve_websocket(accepted_socket, websocket_route, &request, buffer,
+                        received_bytes) == -1) {
+      fprintf(stderr, "not a websocket handshake, responding 400\n");
+      send_400_response(accepted_socket);
+    } else {
+      close(accepted_socket);
+    }
+    free(request.headers);
+    return;
+  }
+
+  HandlerRoute *handler_route =
+      find_handler_route(url, request_line.relative_path.path_length);
+  if (handler_route) {
+    run_handler(accepted_socket, handler_route, &request, buffer,
+                received_bytes);
+    free(request.headers);
+    close(accepted_socket);
+    return;
+  }
+
+  ProxyRoute *route =
+      find_proxy_route(url, request_line.relative_path.path_length);
+  if (route) {
+    if (proxy_request(accepted_socket, route, &request, buffer,
+                      received_bytes) == -1) {
+      fprintf(stderr, "can't proxy request, responding 400\n");
+      send_400_response(accepted_socket);
+    } else {
+      close(accepted_socket);
+    }
+    free(request.headers);
+    return;
+  }
+
+  const AssetEntry *asset =
+      find_asset(url, request_line.relative_path.path_length);
+  if (asset) {
+    trace_stage(span, STAGE_OPENED);
+    serve_asset(accepted_socket, asset, &request);
+    free(request.headers);
+    close(accepted_socket);
+    return;
+  }
 
   char filepath[256];
   int filepath_bytes_written;
@@ -150,102 +160,52 @@ void serve_request(Task *task) {
                  request_line.relative_path.path_length, url);
   }
 
-  long file_size = 0;
-  const char *file_to_send = read_file(filepath, &file_size);
-
-  int attempts = 1;
-  while (file_to_send == NULL && attempts < MAX_ATTEMPTS) {
-    file_to_send = read_file(request_line.relative_path.path, &file_size);
-    ++attempts;
-  }
-
-  if (file_to_send == NULL) {
-    fprintf(stderr, "file_to_send is NULL, responding 400\n");
+  // the file is streamed with sendfile in whatever pieces the socket takes,
+  // so nothing here grows with its size
+  int file = open(filepath, O_RDONLY);
+  struct stat file_stat;
+  if (file == -1 || fstat(file, &file_stat) == -1 ||
+      !S_ISREG(file_stat.st_mode)) {
+    perror("failed to open file to send");
+    if (file != -1)
+      close(file);
+    fprintf(stderr, "can't send %s, responding 400\n", filepath);
     send_400_response(accepted_socket);
     free(request.headers);
     return;
   }
 
-  const char *response_header = "HTTP/1.0 200\r\n";
-  message_length += 14;
+  trace_stage(span, STAGE_OPENED);
 
-  char content_length_header[50];
-  int content_length_bytes_written = snprintf(
-      content_length_header, 50, "Content-Length: %ld\r\n", file_size + 1);
-  if (content_length_bytes_written > 50) {
-    fprintf(stderr, "wrote too large a content length, responding 400\n");
-    send_400_response(accepted_socket);
-    free(request.headers);
-    free((void *)file_to_send);
-    return;
-  }
-
-  const char *content_type = NULL;
+  ResponseWriter response;
+  init_response_writer(&response, accepted_socket, &request);
   if (request_line.relative_path.path_length == 12 &&
       strncmp(url, "/favicon.ico", 12) == 0) {
-    content_type = "Content-Type: image/ico\r\n";
+    response_add_header(&response, "Content-Type", "image/ico");
   } else {
-    content_type = "Content-Type: text/html; charset=utf-8\r\n";
+    response_add_header(&response, "Content-Type", "text/html; charset=utf-8");
   }
+  response_set_content_length(&response, file_stat.st_size);
 
-  char http_response[8192];
-  int message_bytes_written =
-      snprintf(http_response, 8192, "%s%s%s\r\n%s", response_header,
-               content_length_header, content_type, file_to_send);
-  if (message_bytes_written > 8192) {
-    fprintf(stderr, "wrote too large a message, responding 400\n");
-    send_400_response(accepted_socket);
-    free((void *)file_to_send);
-    return;
-  }
-
-  printf("sending message:\n%s\n", http_response);
-
-  if (send_all(accepted_socket, http_response, message_bytes_written + 1,
-               &sent_bytes) == -1) {
-    perror("sent -1 bytes");
+  if (response_send_file(&response, file, 0, file_stat.st_size) == -1 ||
+      response_finish(&response) == -1) {
+    fprintf(stderr, "failed sending %s\n", filepath);
   }
 
   printf("Finished serving request\n");
-  free((void *)file_to_send);
+  close(file);
   free(request.headers);
   close(accepted_socket);
 }
 
-void submit_task(TaskQueue *queue, Task *task) {
-  // submitting the task is a critical section for the main thread
-  pthread_mutex_lock(&queue_mutex);
-  enqueue_task(queue, task);
-  pthread_mutex_unlock(&queue_mutex);
-  pthread_cond_signal(&queue_condition);
-}
-
-// args will be/contain a task queue pointer
-void *start_server_thread(void *args) {
-  TaskQueue *task_queue = (TaskQueue *)args;
-
-  // critical section is checking the shared queue for a task
-  // don't want two threads data racing for the same task
-  // get the lock and wait until the task queue has non zero size
-  // this thread will be blocking but thats okay, there's no work to do
-  while (1) {
-    pthread_mutex_lock(&queue_mutex);
-
-    while (task_queue->size == 0)
-      pthread_cond_wait(&queue_condition, &queue_mutex);
-
-    // want the actual serving to occur outside the critical section in
-    // parallel unlock once we got something to do allow another thread to
-    // start waiting on stuff to do
-    Task *task = dequeue_task(task_queue);
-    pthread_mutex_unlock(&queue_mutex);
-
-    assert(task);
-    serve_request(task);
-
-    task = NULL;
-    free(task);
-  }
+// every request gets a span, whichever way it's answered
+void serve_request(Task *task) {
+  RequestSpan span;
+  start_span(&span, task);
+  start_capture(task->socket, task->accepted_at);
+  handle_request(task->socket, &span);
+  finish_capture();
+  finish_span(&span);
 }
 
 int main() {
@@ -259,25 +219,31 @@ int main() {
     exit(1);
   }
 
+  // a client or backend hanging up mid send should fail the send, not kill
+  // the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (load_config(CONFIG_PATH) == -1) {
+    fprintf(stderr, "failed to load %s\n", CONFIG_PATH);
+    exit(1);
+  }
+  start_proxy_health_checks();
+
   int listener_socket = get_socket();
-  pthread_mutex_init(&queue_mutex, NULL);
-  pthread_cond_init(&queue_condition, NULL);
-  TaskQueue task_queue = new_task_queue();
-  ThreadPool thread_pool = new_thread_pool(&start_server_thread, &task_queue);
+  start_thread_pool(&thread_pool, serve_request);
 
-  uint64_t main_tid;
-  pthread_threadid_np(NULL, &main_tid);
-  printf("main thread is %llu\n", main_tid);
+  printf("main thread is %ld\n", (long)syscall(SYS_gettid));
 
   while (1) {
-    printf("waiting to accept a socket, size %d\n", task_queue.size);
+    printf("waiting to accept a socket\n");
     int accepted_socket = accept_connection(listener_socket);
-    printf("accepted socket, size %d\n", task_queue.size);
-    submit_task(&task_queue, new_task(accepted_socket));
+    if (accepted_socket == -1) {
+      perror("accept");
+      continue;
+    }
+    printf("accepted socket %d\n", accepted_socket);
+    submit_task(&thread_pool, new_task(accepted_socket));
   }
 
-  pthread_mutex_destroy(&queue_mutex);
-  pthread_cond_destroy(&queue_condition);
-
   return 0;
 }
@@ -0,0 +1,901 @@
+#include "http_server.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PROXY_BUFFER_LENGTH 8192
+#define MAX_IDLE_CONNECTIONS 8
+#define PROXY_MAX_ATTEMPTS 3
+#define HEALTH_CHECK_INTERVAL 5
+#define MAX_FORWARD_SPANS 64
+#define CONNECT_TIMEOUT_MILLISECONDS 2000
+// a chunk size with more hex digits than this doesn't fit in a long
+#define MAX_CHUNK_SIZE_DIGITS 15
+
+// PROXY_UNSENT means the request never fully went out, so any request can be
+// sent again. PROXY_RETRY means it went out and the connection closed before
+// a response, which is only safe to send again if the method is idempotent.
+// PROXY_REJECTED means the client's request can't be forwarded as it is
+enum { PROXY_DONE, PROXY_UNSENT, PROXY_RETRY, PROXY_FAILED, PROXY_REJECTED };
+
+static ProxyRoute routes[MAX_PROXY_ROUTES];
+static int route_count = 0;
+static Backend backends[MAX_PROXY_BACKENDS];
+static int backend_count = 0;
+
+// every worker keeps its own idle keep-alive connections, so taking one from
+// the pool or putting one back never needs a lock
+static __thread int idle_connections[MAX_PROXY_BACKENDS][MAX_IDLE_CONNECTIONS];
+static __thread int idle_counts[MAX_PROXY_BACKENDS];
+
+static const char keep_alive_line[] = "Connection: keep-alive\r\n\r\n";
+static const char close_line[] = "Connection: close\r\n\r\n";
+static const char blank_line[] = "\r\n";
+static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+// backend specs look like 127.0.0.1:8080 or unix:/tmp/app.sock
+static int add_backend(const char *spec) {
+  if (backend_count == MAX_PROXY_BACKENDS) {
+    fprintf(stderr, "too many proxy backends\n");
+    return -1;
+  }
+
+  Backend backend;
+  memset(&backend, 0, sizeof(backend));
+  backend.healthy = 1;
+
+  if (strncmp(spec, "unix:", 5) == 0) {
+    backend.is_unix = 1;
+    backend.unix_path = strdup(spec + 5);
+    if (strlen(backend.unix_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+      fprintf(stderr, "unix socket path too long: %s\n", backend.unix_path);
+      free(backend.unix_path);
+      return -1;
+    }
+  } else {
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || colon[1] == '\0') {
+      fprintf(stderr, "backend %s should be host:port\n", spec);
+      return -1;
+    }
+    backend.host = strndup(spec, colon - spec);
+    backend.port = strdup(colon + 1);
+  }
+
+  backends[backend_count] = backend;
+  return backend_count++;
+}
+
+// proxy <prefix> <backend> [backend...]
+int add_proxy_route(int argc, char **argv) {
+  if (argc < 2 || argv[0][0] != '/') {
+    fprintf(stderr, "usage: proxy /prefix host:port|unix:/path ...\n");
+    return -1;
+  }
+  if (route_count == MAX_PROXY_ROUTES) {
+    fprintf(stderr, "too many proxy routes\n");
+    return -1;
+  }
+  if (argc - 1 > MAX_BACKENDS_PER_ROUTE) {
+    fprintf(stderr, "too many backends for route %s\n", argv[0]);
+    return -1;
+  }
+
+  ProxyRoute route;
+  memset(&route, 0, sizeof(route));
+  route.prefix.path = strdup(argv[0]);
+  route.prefix.length = strlen(argv[0]);
+
+  for (int i = 1; i < argc; i++) {
+    int backend = add_backend(argv[i]);
+    if (backend == -1) {
+      free(route.prefix.path);
+      return -1;
+    }
+    route.backends[route.num_backends++] = backend;
+  }
+
+  routes[route_count++] = route;
+  return 0;
+}
+
+ProxyRoute *find_proxy_route(const char *path, unsigned path_length) {
+  int index = longest_route_match(routes, route_count, sizeof(ProxyRoute), path,
+                                  path_length);
+  return index == -1 ? NULL : &routes[index];
+}
+
+static int connect_backend(const Backend *backend) {
+  int upstream;
+
+  if (backend->is_unix) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, backend->unix_path, sizeof(address.sun_path) - 1);
+
+    if ((upstream = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+      perror("proxy socket");
+      return -1;
+    }
+    if (co_connect(upstream, (struct sockaddr *)&address, sizeof(address),
+                   CONNECT_TIMEOUT_MILLISECONDS) == -1) {
+      close(upstream);
+      return -1;
+    }
+    return upstream;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo *upstream_info;
+  struct addrinfo *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int addrinfo_status;
+  if ((addrinfo_status = getaddrinfo(backend->host, backend->port, &hints,
+                                     &upstream_info)) != 0) {
+    fprintf(stderr, "proxy getaddrinfo error: %s\n",
+            gai_strerror(addrinfo_status));
+    return -1;
+  }
+
+  upstream = -1;
+  for (info = upstream_info; info; info = info->ai_next) {
+    upstream = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (upstream == -1)
+      continue;
+    if (co_connect(upstream, info->ai_addr, info->ai_addrlen,
+                   CONNECT_TIMEOUT_MILLISECONDS) == 0)
+      break;
+    close(upstream);
+    upstream = -1;
+  }
+  freeaddrinfo(upstream_info);
+
+  if (upstream != -1) {
+    // requests are small and latency bound, don't let nagle hold them back
+    int opt = 1;
+    setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  }
+
+  return upstream;
+}
+
+// an idle connection the backend has since closed reads as EOF, and one with
+// unsolicited data is out of sync. either way it can't carry a request
+static int is_idle_connection_usable(int upstream) {
+  char byte;
+  long peeked = recv(upstream, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int take_idle_connection(int backend) {
+  while (idle_counts[backend] > 0) {
+    int upstream = idle_connections[backend][--idle_counts[backend]];
+    if (is_idle_connection_usable(upstream))
+      return upstream;
+    close(upstream);
+  }
+  return -1;
+}
+
+static void release_connection(int backend, int upstream, int reusable) {
+  if (reusable && idle_counts[backend] < MAX_IDLE_CONNECTIONS) {
+    idle_connections[backend][idle_counts[backend]++] = upstream;
+    return;
+  }
+  close(upstream);
+}
+
+// least outstanding requests among the healthy backends not tried yet. if
+// every backend looks down, fall back to any untried one rather than failing
+// on a possibly stale health check
+static int pick_backend(const ProxyRoute *route, unsigned tried) {
+  int best = -1;
+  int best_outstanding = 0;
+
+  for (int pass = 0; pass < 2 && best == -1; pass++) {
+    for (int i = 0; i < route->num_backends; i++) {
+      if (tried & (1u << i))
+        continue;
+      Backend *backend = &backends[route->backends[i]];
+      if (pass == 0 && !__atomic_load_n(&backend->healthy, __ATOMIC_RELAXED))
+        continue;
+      int outstanding =
+          __atomic_load_n(&backend->outstanding, __ATOMIC_RELAXED);
+      if (best == -1 || outstanding < best_outstanding) {
+        best = i;
+        best_outstanding = outstanding;
+      }
+    }
+  }
+
+  return best;
+}
+
+static int header_is(const char *name, unsigned length, const char *expected) {
+  return length == strlen(expected) && strncasecmp(name, expected, length) == 0;
+}
+
+static int is_hop_by_hop(const char *name, unsigned length) {
+  return header_is(name, length, "Connection") ||
+         header_is(name, length, "Keep-Alive") ||
+         header_is(name, length, "Proxy-Connection") ||
+         header_is(name, length, "TE") || header_is(name, length, "Trailer") ||
+         header_is(name, length, "Upgrade");
+}
+
+// whether the comma separated list has name as one of its elements
+static int list_has(const char *list, unsigned list_length, const char *name,
+                    unsigned length) {
+  const char *cursor = list;
+  const char *element;
+  unsigned element_length;
+  while (next_list_element(&cursor, list + list_length, &element,
+                           &element_length)) {
+    if (element_length == length && strncasecmp(element, name, length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int is_idempotent(const char *method, unsigned length) {
+  return header_is(method, length, "GET") ||
+         header_is(method, length, "HEAD") ||
+         header_is(method, length, "PUT") ||
+         header_is(method, length, "DELETE") ||
+         header_is(method, length, "OPTIONS");
+}
+
+// chunked has to be the last transfer coding applied for it to frame the body
+static int is_chunked_coding(const char *value, unsigned length) {
+  const char *cursor = value;
+  const char *coding = NULL;
+  const char *element;
+  unsigned element_length;
+  unsigned coding_length = 0;
+  while (next_list_element(&cursor, value + length, &element,
+                           &element_length)) {
+    coding = element;
+    coding_length = element_length;
+  }
+  return coding && header_is(coding, coding_length, "chunked");
+}
+
+static int is_http_1_1(const HTTP_Request *request) {
+  return request->request_line.http_major == 1 &&
+         request->request_line.http_minor >= 1;
+}
+
+static long request_content_length(const HTTP_Request *request) {
+  const Header *header = find_header(request, "Content-Length");
+  return header ? strtol(header->body_string, NULL, 10) : 0;
+}
+
+// hop by hop headers, whatever the request's Connection headers name, and
+// Expect, which the proxy answers itself. with a chunked body Content-Length
+// goes too, so upstream can't frame the body differently from us
+static int is_dropped_request_header(const HTTP_Request *request,
+                                     const Header *header, int is_chunked) {
+  const char *name = header->header_string;
+  unsigned length = header->header_length;
+  if (is_hop_by_hop(name, length) || header_is(name, length, "Expect") ||
+      (is_chunked && header_is(name, length, "Content-Length")))
+    return 1;
+
+  for (unsigned i = 0; i < request->num_headers; i++) {
+    const Header *connection = &request->headers[i];
+    if (header_is(connection->header_string, connection->header_length,
+                  "Connection") &&
+        list_has(connection->body_string, connection->body_length, name,
+                 length))
+      return 1;
+  }
+  return 0;
+}
+
+// the request line and end to end headers go upstream as the bytes the client
+// sent, pointing straight into the receive buffer. only the dropped headers
+// are cut out, and our own Connection header is added at the end. returns -1
+// if that takes more spans than there are, with room left for the body
+static int build_request_spans(const HTTP_Request *request, const char *raw,
+                               int is_chunked, struct iovec *spans) {
+  const char *end = raw + request->header_bytes - 2;
+  const char *span_start = raw;
+  int count = 0;
+
+  for (unsigned i = 0; i < request->num_headers; i++) {
+    const Header *header = &request->headers[i];
+    if (!is_dropped_request_header(request, header, is_chunked))
+      continue;
+    if (count == MAX_FORWARD_SPANS - 3)
+      return -1;
+
+    if (header->header_string > span_start) {
+      spans[count].iov_base = (void *)span_start;
+      spans[count].iov_len = header->header_string - span_start;
+      count++;
+    }
+    span_start = i + 1 < request->num_headers
+                     ? request->headers[i + 1].header_string
+                     : end;
+  }
+
+  if (end > span_start) {
+    spans[count].iov_base = (void *)span_start;
+    spans[count].iov_len = end - span_start;
+    count++;
+  }
+
+  spans[count].iov_base = (void *)keep_alive_line;
+  spans[count].iov_len = sizeof(keep_alive_line) - 1;
+  return count + 1;
+}
+
+// copies exactly length bytes from one socket to the other through buffer
+static int relay_bytes(int from, int to, long length, char *buffer) {
+  long sent_bytes;
+  while (length > 0) {
+    long want = length < PROXY_BUFFER_LENGTH ? length : PROXY_BUFFER_LENGTH;
+    long received = co_recv(from, buffer, want, 0);
+    if (received <= 0)
+      return -1;
+    if (send_all(to, buffer, received, &sent_bytes) == -1)
+      return -1;
+    length -= received;
+  }
+  return 0;
+}
+
+typedef struct {
+  int status;
+  long content_length;
+  int is_chunked;
+  int keep_alive;
+  unsigned header_bytes;
+} UpstreamResponse;
+
+static long find_header_end(const char *buffer, unsigned length) {
+  for (unsigned i = 3; i < length; i++) {
+    if (buffer[i] == '\n' && buffer[i - 1] == '\r' && buffer[i - 2] == '\n' &&
+        buffer[i - 3] == '\r')
+      return i + 1;
+  }
+  return -1;
+}
+
+// splits the header line at line into its name and value and returns where
+// the next line starts. a line with no colon has a name_length of 0
+static const char *split_header_line(const char *line, const char *end,
+                                     unsigned *name_length, const char **value,
+                                     unsigned *value_length) {
+  const char *line_end = line;
+  while (line_end < end && *line_end != '\r')
+    line_end++;
+
+  const char *colon = memchr(line, ':', line_end - line);
+  *name_length = colon ? colon - line : 0;
+  *value = colon ? colon + 1 : line_end;
+  while (*value < line_end && (**value == ' ' || **value == '\t'))
+    (*value)++;
+  *value_length = line_end - *value;
+  return line_end + 2;
+}
+
+// whether a Connection header among the lines up to end names name
+static int is_named_by_connection(const char *lines, const char *end,
+                                  const char *name, unsigned length) {
+  const char *value;
+  unsigned name_length, value_length;
+  for (const char *line = lines; line < end;) {
+    const char *next =
+        split_header_line(line, end, &name_length, &value, &value_length);
+    if (header_is(line, name_length, "Connection") &&
+        list_has(value, value_length, name, length))
+      return 1;
+    line = next;
+  }
+  return 0;
+}
+
+// reads the status line and the headers that decide how the body is framed.
+// the header block is handed to the client as is, minus hop by hop headers
+// and whatever Connection names. the spans stop short of the blank line, so
+// the caller can end the block with its own
+static int parse_upstream_response(const char *text, UpstreamResponse *response,
+                                   struct iovec *spans) {
+  unsigned major, minor;
+  int status;
+  if (sscanf(text, "HTTP/%u.%u %d", &major, &minor, &status) != 3)
+    return -1;
+
+  response->status = status;
+  response->content_length = -1;
+  response->is_chunked = 0;
+  response->keep_alive = major == 1 && minor >= 1;
+
+  const char *end = text + response->header_bytes - 2;
+  const char *lines = strstr(text, "\r\n") + 2;
+  const char *value;
+  unsigned name_length, value_length;
+  int has_transfer_encoding = 0;
+  int has_connection = 0;
+
+  for (const char *line = lines; line < end;) {
+    const char *next =
+        split_header_line(line, end, &name_length, &value, &value_length);
+    if (header_is(line, name_length, "Content-Length")) {
+      response->content_length = strtol(value, NULL, 10);
+    } else if (header_is(line, name_length, "Transfer-Encoding")) {
+      has_transfer_encoding = 1;
+      response->is_chunked = is_chunked_coding(value, value_length);
+    } else if (header_is(line, name_length, "Connection")) {
+      has_connection = 1;
+      if (list_has(value, value_length, "close", 5))
+        response->keep_alive = 0;
+      else if (list_has(value, value_length, "keep-alive", 10))
+        response->keep_alive = 1;
+    }
+    line = next;
+  }
+
+  // Transfer-Encoding frames the body whenever both are there, and the
+  // Content-Length isn't passed on to confuse anyone downstream
+  if (has_transfer_encoding)
+    response->content_length = -1;
+
+  const char *span_start = text;
+  int count = 0;
+
+  for (const char *line = lines; line < end && count < MAX_FORWARD_SPANS - 2;) {
+    const char *next =
+        split_header_line(line, end, &name_length, &value, &value_length);
+    int is_dropped =
+        name_length &&
+        (is_hop_by_hop(line, name_length) ||
+         (has_transfer_encoding &&
+          header_is(line, name_length, "Content-Length")) ||
+         (has_connection &&
+          is_named_by_connection(lines, end, line, name_length)));
+
+    if (is_dropped) {
+      if (line > span_start) {
+        spans[count].iov_base = (void *)span_start;
+        spans[count].iov_len = line - span_start;
+        count++;
+      }
+      span_start = next;
+    }
+    line = next;
+  }
+
+  if (end > span_start) {
+    spans[count].iov_base = (void *)span_start;
+    spans[count].iov_len = end - span_start;
+    count++;
+  }
+  return count;
+}
+
+// tracks where a chunked body ends without decoding it, so the bytes can be
+// passed through untouched and the upstream connection reused afterwards
+enum {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+  CHUNK_DONE,
+  CHUNK_ERROR
+};
+
+typedef struct {
+  int state;
+  long remaining;
+  unsigned line_length;
+} ChunkedState;
+
+// returns how many bytes of data belong to the body, stopping at its end. a
+// chunk size too big to count stops it early in CHUNK_ERROR
+static unsigned advance_chunked(ChunkedState *chunked, const char *data,
+                                unsigned length) {
+  unsigned i = 0;
+
+  while (i < length && chunked->state != CHUNK_DONE &&
+         chunked->state != CHUNK_ERROR) {
+    char c = data[i];
+    int is_hex_digit = (c >= '0' && c <= '9') ||
+                       ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+
+    switch (chunked->state) {
+    case CHUNK_SIZE:
+    case CHUNK_EXTENSION:
+      if (c == '\n') {
+        chunked->state = chunked->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+        chunked->line_length = 0;
+      } else if (chunked->state == CHUNK_SIZE && is_hex_digit) {
+        // line_length counts the size's digits until the line ends
+        if (++chunked->line_length > MAX_CHUNK_SIZE_DIGITS) {
+          chunked->state = CHUNK_ERROR;
+          break;
+        }
+        int digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        chunked->remaining = chunked->remaining * 16 + digit;
+      } else if (c != '\r') {
+        chunked->state = CHUNK_EXTENSION;
+      }
+      i++;
+      break;
+
+    case CHUNK_DATA: {
+      unsigned available = length - i;
+      unsigned take = chunked->remaining < available ? chunked->remaining
+                                                     : available;
+      chunked->remaining -= take;
+      i += take;
+      if (chunked->remaining == 0)
+        chunked->state = CHUNK_DATA_END;
+      break;
+    }
+
+    case CHUNK_DATA_END:
+      if (c == '\n')
+        chunked->state = CHUNK_SIZE;
+      i++;
+      break;
+
+    case CHUNK_TRAILER:
+      if (c == '\n') {
+        if (chunked->line_length == 0)
+          chunked->state = CHUNK_DONE;
+        chunked->line_length = 0;
+      } else if (c != '\r') {
+        chunked->line_length++;
+      }
+      i++;
+      break;
+    }
+  }
+
+  return i;
+}
+
+// returns 1 when the body ended on a message boundary and the upstream
+// connection can carry another request, 0 when it can't and -1 on error.
+// buffered bytes of the body are already at the start of buffer, and the
+// whole buffer is free to read the rest into
+static int relay_response_body(int upstream, int client,
+                               const UpstreamResponse *response, int is_head,
+                               char *buffer, unsigned buffered) {
+  long sent_bytes;
+  int status = response->status;
+
+  if (is_head || status == 204 || status == 304)
+    return buffered == 0;
+
+  if (response->content_length >= 0) {
+    long remaining = response->content_length;
+    unsigned first = buffered < remaining ? buffered : remaining;
+    if (send_all(client, buffer, first, &sent_bytes) == -1)
+      return -1;
+    if (relay_bytes(upstream, client, remaining - first, buffer) == -1)
+      return -1;
+    return buffered <= remaining;
+  }
+
+  if (response->is_chunked) {
+    ChunkedState chunked;
+    memset(&chunked, 0, sizeof(chunked));
+    unsigned length = buffered;
+
+    while (1) {
+      unsigned body_bytes = advance_chunked(&chunked, buffer, length);
+      if (chunked.state == CHUNK_ERROR) {
+        fprintf(stderr, "upstream sent a chunk size that's too large\n");
+        return -1;
+      }
+      if (send_all(client, buffer, body_bytes, &sent_bytes) == -1)
+        return -1;
+      if (chunked.state == CHUNK_DONE)
+        return body_bytes == length;
+
+      long received = co_recv(upstream, buffer, PROXY_BUFFER_LENGTH, 0);
+      if (received <= 0)
+        return -1;
+      length = received;
+    }
+  }
+
+  // no framing, the body runs until the backend closes
+  if (send_all(client, buffer, buffered, &sent_bytes) == -1)
+    return -1;
+  long received;
+  while ((received = co_recv(upstream, buffer, PROXY_BUFFER_LENGTH, 0)) > 0) {
+    if (send_all(client, buffer, received, &sent_bytes) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+// passes a chunked request body from the client through to upstream as is,
+// carrying on from wherever the bytes that came with the headers left off.
+// on a bad chunk size it stops with chunked in CHUNK_ERROR
+static int relay_chunked_request(int client, int upstream,
+                                 ChunkedState *chunked, char *buffer) {
+  long sent_bytes;
+  while (chunked->state != CHUNK_DONE) {
+    long received = co_recv(client, buffer, PROXY_BUFFER_LENGTH, 0);
+    if (received <= 0)
+      return -1;
+    unsigned body_bytes = advance_chunked(chunked, buffer, received);
+    if (chunked->state == CHUNK_ERROR)
+      return -1;
+    if (send_all(upstream, buffer, body_bytes, &sent_bytes) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+// reads upstream until buffer holds a whole header block and returns its
+// length. length is how much is in buffer already, and is updated
+static long read_response_headers(int upstream, char *buffer,
+                                  unsigned *length) {
+  long header_end = find_header_end(buffer, *length);
+  while (header_end == -1) {
+    if (*length == PROXY_BUFFER_LENGTH - 1) {
+      fprintf(stderr, "upstream response headers too large\n");
+      return -1;
+    }
+    long received = co_recv(upstream, buffer + *length,
+                            PROXY_BUFFER_LENGTH - 1 - *length, 0);
+    if (received <= 0)
+      return -1;
+    *length += received;
+    buffer[*length] = '\0';
+    header_end = find_header_end(buffer, *length);
+  }
+  return header_end;
+}
+
+// sends one request over upstream and streams the response back. nothing is
+// sent to the client until the response headers are in, so PROXY_UNSENT and
+// PROXY_RETRY mean the request can go to another connection. a content_length
+// of -1 means the body is chunked
+static int forward_request(int client, int upstream, const HTTP_Request *request,
+                           const char *raw, unsigned raw_length,
+                           long content_length, int *reusable) {
+  struct iovec spans[MAX_FORWARD_SPANS];
+  ChunkedState chunked;
+  memset(&chunked, 0, sizeof(chunked));
+  *reusable = 0;
+
+  int count = build_request_spans(request, raw, content_length == -1, spans);
+  if (count == -1) {
+    fprintf(stderr, "too many hop by hop headers to proxy\n");
+    return PROXY_REJECTED;
+  }
+
+  // whatever part of the body came in with the headers goes in the same write
+  unsigned buffered_body = raw_length - request->header_bytes;
+  if (content_length == -1) {
+    buffered_body =
+        advance_chunked(&chunked, raw + request->header_bytes, buffered_body);
+    if (chunked.state == CHUNK_ERROR)
+      return PROXY_REJECTED;
+  } else if (buffered_body > content_length) {
+    buffered_body = content_length;
+  }
+  if (buffered_body) {
+    spans[count].iov_base = (void *)(raw + request->header_bytes);
+    spans[count].iov_len = buffered_body;
+    count++;
+  }
+
+  if (writev_all(upstream, spans, count) == -1)
+    return PROXY_UNSENT;
+
+  char buffer[PROXY_BUFFER_LENGTH];
+  int body_status =
+      content_length == -1
+          ? relay_chunked_request(client, upstream, &chunked, buffer)
+          : relay_bytes(client, upstream, content_length - buffered_body,
+                        buffer);
+  if (chunked.state == CHUNK_ERROR)
+    return PROXY_REJECTED;
+  if (body_status == -1)
+    return PROXY_FAILED;
+
+  // interim 1xx responses go to the client as they come, HTTP/1.0 clients
+  // don't know about them so they're dropped there. the final response is
+  // the first one with any other status
+  int is_client_1_1 = is_http_1_1(request);
+  int sent_interim = 0;
+  unsigned length = 0;
+  UpstreamResponse response;
+
+  while (1) {
+    long header_end = read_response_headers(upstream, buffer, &length);
+    if (header_end == -1)
+      return length == 0 && !sent_interim ? PROXY_RETRY : PROXY_FAILED;
+
+    response.header_bytes = header_end;
+    count = parse_upstream_response(buffer, &response, spans);
+    if (count == -1) {
+      fprintf(stderr, "upstream sent a malformed status line\n");
+      return PROXY_FAILED;
+    }
+    if (response.status == 101) {
+      fprintf(stderr, "upstream switched protocols, which can't be proxied\n");
+      return PROXY_FAILED;
+    }
+    int is_interim = response.status >= 100 && response.status < 200;
+
+    if (!is_interim || is_client_1_1) {
+      spans[count].iov_base = (void *)(is_interim ? blank_line : close_line);
+      spans[count].iov_len =
+          is_interim ? sizeof(blank_line) - 1 : sizeof(close_line) - 1;
+      if (writev_all(client, spans, count + 1) == -1)
+        return PROXY_DONE;
+      sent_interim = is_interim;
+    }
+
+    // the header block is out, so whatever came after it moves to the front
+    // and the whole buffer is free again
+    length -= header_end;
+    memmove(buffer, buffer + header_end, length);
+    buffer[length] = '\0';
+    if (!is_interim)
+      break;
+  }
+
+  int is_head = header_is(request->request_line.method,
+                          request->request_line.method_length, "HEAD");
+  body_status = relay_response_body(upstream, client, &response, is_head,
+                                    buffer, length);
+  *reusable = body_status == 1 && response.keep_alive;
+  return PROXY_DONE;
+}
+
+static void send_502_response(int client) {
+  long sent_bytes;
+  const char *message = "HTTP/1.0 502\r\n\r\n";
+  send_all(client, message, 16, &sent_bytes);
+}
+
+// returns -1 if the request can't be proxied, so the caller can answer it.
+// nothing but a 100 Continue has gone to the client by then
+int proxy_request(int client_socket, ProxyRoute *route,
+                  const HTTP_Request *request, const char *raw,
+                  unsigned raw_length) {
+  if (request->request_line.is_simple)
+    return -1;
+
+  // a chunked body is relayed as it arrives, so it's treated as never being
+  // all in raw, and any Content-Length alongside it is ignored and dropped.
+  // any other transfer coding isn't understood
+  const Header *transfer_encoding = find_header(request, "Transfer-Encoding");
+  long content_length;
+  int is_replayable;
+  if (transfer_encoding) {
+    if (!is_chunked_coding(transfer_encoding->body_string,
+                           transfer_encoding->body_length))
+      return -1;
+    content_length = -1;
+    is_replayable = 0;
+  } else {
+    content_length = request_content_length(request);
+    if (content_length < 0)
+      return -1;
+    // the request can only be sent again if all of it is still in raw
+    is_replayable = raw_length - request->header_bytes >= content_length;
+  }
+  // a client waiting on 100 Continue would hold the body back while we wait
+  // to relay all of it, so it's answered here and Expect never goes upstream
+  const Header *expect = find_header(request, "Expect");
+  if (expect && !is_replayable && is_http_1_1(request) &&
+      header_is(expect->body_string, expect->body_length, "100-continue")) {
+    long sent_bytes;
+    if (send_all(client_socket, continue_response,
+                 sizeof(continue_response) - 1, &sent_bytes) == -1)
+      return 0;
+  }
+
+  int is_safe_to_retry =
+      is_idempotent(request->request_line.method,
+                    request->request_line.method_length);
+  unsigned tried = 0;
+
+  for (int attempt = 0; attempt < PROXY_MAX_ATTEMPTS; attempt++) {
+    int index = pick_backend(route, tried);
+    if (index == -1)
+      break;
+    int backend_id = route->backends[index];
+    Backend *backend = &backends[backend_id];
+
+    int is_reused = 1;
+    int upstream = take_idle_connection(backend_id);
+    if (upstream == -1) {
+      is_reused = 0;
+      upstream = connect_backend(backend);
+    }
+    if (upstream == -1) {
+      __atomic_store_n(&backend->healthy, 0, __ATOMIC_RELAXED);
+      tried |= 1u << index;
+      continue;
+    }
+
+    int reusable;
+    __atomic_fetch_add(&backend->outstanding, 1, __ATOMIC_RELAXED);
+    int result = forward_request(client_socket, upstream, request, raw,
+                                 raw_length, content_length, &reusable);
+    __atomic_fetch_sub(&backend->outstanding, 1, __ATOMIC_RELAXED);
+    release_connection(backend_id, upstream, reusable);
+
+    if (result == PROXY_DONE)
+      return 0;
+    if (result == PROXY_REJECTED)
+      return -1;
+
+    // a pooled connection the backend dropped under us is expected, so try
+    // again on a fresh one before moving to the next backend. nothing past
+    // raw is read from the client until the request is written, so an unsent
+    // one can always go again. once the backend may have seen all of it, only
+    // idempotent ones can
+    if (result == PROXY_UNSENT ||
+        (result == PROXY_RETRY && is_replayable && is_safe_to_retry)) {
+      if (!is_reused)
+        tried |= 1u << index;
+      continue;
+    }
+    break;
+  }
+
+  send_502_response(client_socket);
+  return 0;
+}
+
+static void *run_health_checks(void *args) {
+  while (1) {
+    for (int i = 0; i < backend_count; i++) {
+      int upstream = connect_backend(&backends[i]);
+      int healthy = upstream != -1;
+      if (healthy)
+        close(upstream);
+
+      if (healthy != __atomic_load_n(&backends[i].healthy, __ATOMIC_RELAXED)) {
+        printf("backend %s%s%s is %s\n",
+               backends[i].is_unix ? backends[i].unix_path : backends[i].host,
+               backends[i].is_unix ? "" : ":",
+               backends[i].is_unix ? "" : backends[i].port,
+               healthy ? "up" : "down");
+      }
+      __atomic_store_n(&backends[i].healthy, healthy, __ATOMIC_RELAXED);
+    }
+    sleep(HEALTH_CHECK_INTERVAL);
+  }
+  return NULL;
+}
+
+void start_proxy_health_checks() {
+  if (backend_count == 0)
+    return;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_health_checks, NULL) != 0) {
+    fprintf(stderr, "Failed to create health check thread\n");
+    return;
+  }
+  pthread_detach(thread);
+}
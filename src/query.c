@@ -0,0 +1,154 @@
+#include "http_server.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// query: key=value pairs split on &, with + standing in for a space
+QueryIterator iterate_query(const RelativePath *relative_path) {
+  QueryIterator iterator;
+  iterator.next = relative_path->query;
+  iterator.end = relative_path->query + relative_path->query_length;
+  iterator.separator = '&';
+  iterator.plus_is_space = 1;
+  return iterator;
+}
+
+// params: param *(";" param), + is just a +
+QueryIterator iterate_params(const RelativePath *relative_path) {
+  QueryIterator iterator;
+  iterator.next = relative_path->params;
+  iterator.end = relative_path->params + relative_path->params_length;
+  iterator.separator = ';';
+  iterator.plus_is_space = 0;
+  return iterator;
+}
+
+// fills param with the next non empty pair and returns 1, or returns 0 at the
+// end. a pair with no = has an empty value. the value runs to the separator,
+// so a=b=c has the value b=c
+int next_query_param(QueryIterator *iterator, QueryParam *param) {
+  while (iterator->next && iterator->next < iterator->end) {
+    const char *start = iterator->next;
+    unsigned remaining = iterator->end - start;
+    const char *pair_end = memchr(start, iterator->separator, remaining);
+    if (!pair_end)
+      pair_end = iterator->end;
+    iterator->next = pair_end + 1;
+
+    if (pair_end == start)
+      continue;
+
+    const char *equals = memchr(start, '=', pair_end - start);
+    param->key = start;
+    param->plus_is_space = iterator->plus_is_space;
+    if (equals) {
+      param->key_length = equals - start;
+      param->value = equals + 1;
+      param->value_length = pair_end - equals - 1;
+    } else {
+      param->key_length = pair_end - start;
+      param->value = pair_end;
+      param->value_length = 0;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+// compares the key as sent, without decoding it
+int query_param_is(const QueryParam *param, const char *key) {
+  unsigned length = strlen(key);
+  return param->key_length == length && memcmp(param->key, key, length) == 0;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// counts the bytes before the first % (or +, when it means a space), which can
+// be copied through untouched. most values have no escapes at all, so this
+// is where decoding spends its time and it looks at 16 or 8 bytes a step
+static unsigned count_plain_bytes(const char *text, unsigned length,
+                                  int plus_is_space) {
+  unsigned i = 0;
+
+#ifdef __SSE2__
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8(plus_is_space ? '+' : '%');
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(text + i));
+    __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(chunk, percent),
+                                   _mm_cmpeq_epi8(chunk, plus));
+    int mask = _mm_movemask_epi8(matches);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#else
+  // swar: a byte of x is zero exactly where the matching high bit is set in
+  // (x - 0x01..) & ~x & 0x80..
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+  const uint64_t percent = ones * '%';
+  const uint64_t plus = ones * (plus_is_space ? '+' : '%');
+  for (; i + 8 <= length; i += 8) {
+    uint64_t chunk;
+    memcpy(&chunk, text + i, 8);
+    uint64_t a = chunk ^ percent;
+    uint64_t b = chunk ^ plus;
+    uint64_t matches = ((a - ones) & ~a & highs) | ((b - ones) & ~b & highs);
+    if (matches)
+      break;
+  }
+#endif
+
+  for (; i < length; i++) {
+    if (text[i] == '%' || (plus_is_space && text[i] == '+'))
+      break;
+  }
+  return i;
+}
+
+// decodes length bytes of encoded into decoded and returns the decoded length,
+// or -1 on a bad escape. decoded never ends up longer than encoded, so it can
+// be encoded itself to decode in place
+long percent_decode(const char *encoded, unsigned length, char *decoded,
+                    int plus_is_space) {
+  unsigned in = 0;
+  unsigned out = 0;
+
+  while (in < length) {
+    unsigned plain = count_plain_bytes(encoded + in, length - in, plus_is_space);
+    if (decoded + out != encoded + in)
+      memmove(decoded + out, encoded + in, plain);
+    in += plain;
+    out += plain;
+    if (in == length)
+      break;
+
+    if (encoded[in] == '+') {
+      decoded[out++] = ' ';
+      in++;
+      continue;
+    }
+
+    if (length - in < 3)
+      return -1;
+    int high = hex_value(encoded[in + 1]);
+    int low = hex_value(encoded[in + 2]);
+    if (high == -1 || low == -1)
+      return -1;
+    decoded[out++] = (char)(high << 4 | low);
+    in += 3;
+  }
+
+  return out;
+}
@@ -1,13 +1,154 @@
+#define _GNU_SOURCE
+#include "http_server.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define PORT "5556"
-#define PENDING_CONNECTIONS 20
+#define PENDING_CONNECTIONS SOMAXCONN
+
+// set with socket lines in tuke.conf before the listener is made. 0 leaves
+// an option off, or at the kernel's default
+static struct {
+  int backlog;
+  int defer_accept;
+  int fastopen;
+  int nodelay;
+  int cork;
+  int busy_poll;
+  int incoming_cpu;
+  int send_buffer;
+  int receive_buffer;
+} tuning = {.backlog = PENDING_CONNECTIONS};
+
+typedef struct {
+  const char *name;
+  int *value;
+  int is_switch;
+} SocketOption;
+
+static SocketOption socket_options[] = {
+    {"backlog", &tuning.backlog, 0},
+    {"defer_accept", &tuning.defer_accept, 0},
+    {"fastopen", &tuning.fastopen, 0},
+    {"nodelay", &tuning.nodelay, 1},
+    {"cork", &tuning.cork, 1},
+    {"busy_poll", &tuning.busy_poll, 0},
+    {"incoming_cpu", &tuning.incoming_cpu, 1},
+    {"send_buffer", &tuning.send_buffer, 0},
+    {"receive_buffer", &tuning.receive_buffer, 0},
+};
+
+// socket <option> <value>
+// numbers for the sized options, on or off for the switches
+int set_socket_option(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: socket <option> <value>\n");
+    return -1;
+  }
+
+  for (unsigned i = 0; i < sizeof(socket_options) / sizeof(SocketOption);
+       i++) {
+    SocketOption *option = &socket_options[i];
+    if (strcmp(argv[0], option->name) != 0)
+      continue;
+
+    if (option->is_switch) {
+      if (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0) {
+        fprintf(stderr, "socket %s takes on or off\n", option->name);
+        return -1;
+      }
+      *option->value = strcmp(argv[1], "on") == 0;
+      return 0;
+    }
+
+    char *end;
+    long value = strtol(argv[1], &end, 10);
+    if (*end != '\0' || value < 0 || value > 0x7FFFFFFF) {
+      fprintf(stderr, "socket %s takes a number\n", option->name);
+      return -1;
+    }
+    *option->value = value;
+    return 0;
+  }
+
+  fprintf(stderr, "unknown socket option %s\n", argv[0]);
+  return -1;
+}
+
+// a tuning option the kernel refuses is worth a warning, not a dead server
+static void set_option(int socket, int level, int name, int value,
+                       const char *description) {
+  if (setsockopt(socket, level, name, &value, sizeof(value)) == -1)
+    perror(description);
+}
+
+// buffer sizes go on the listener so accepted sockets inherit them, and the
+// receive buffer has to be there before listen to get the right window scale
+static void tune_listener(int listener) {
+  if (tuning.send_buffer)
+    set_option(listener, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer,
+               "setting SO_SNDBUF");
+  if (tuning.receive_buffer)
+    set_option(listener, SOL_SOCKET, SO_RCVBUF, tuning.receive_buffer,
+               "setting SO_RCVBUF");
+  // accept only once the request has arrived, instead of waking for a bare
+  // handshake and then waiting on the first recv
+  if (tuning.defer_accept)
+    set_option(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, tuning.defer_accept,
+               "setting TCP_DEFER_ACCEPT");
+  // returning clients can put the request in the SYN
+  if (tuning.fastopen)
+    set_option(listener, IPPROTO_TCP, TCP_FASTOPEN, tuning.fastopen,
+               "setting TCP_FASTOPEN");
+}
+
+static void tune_connection(int socket) {
+  if (tuning.nodelay)
+    set_option(socket, IPPROTO_TCP, TCP_NODELAY, 1, "setting TCP_NODELAY");
+  if (tuning.busy_poll)
+    set_option(socket, SOL_SOCKET, SO_BUSY_POLL, tuning.busy_poll,
+               "setting SO_BUSY_POLL");
+}
+
+// the cpu that took the connection's packets, so the connection can be
+// handed to the worker pinned there. -1 unless incoming_cpu is on
+int connection_cpu(int socket) {
+  if (!tuning.incoming_cpu)
+    return -1;
+
+  int cpu;
+  socklen_t cpu_length = sizeof(cpu);
+  if (getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_length) ==
+      -1)
+    return -1;
+  return cpu;
+}
+
+int is_steering_connections() { return tuning.incoming_cpu; }
+
+// with cork on, headers and the body sent after them leave as full segments
+// once the body is done, instead of the headers going in a packet of their own
+void cork_connection(int socket) {
+  if (tuning.cork)
+    set_option(socket, IPPROTO_TCP, TCP_CORK, 1, "setting TCP_CORK");
+}
+
+void uncork_connection(int socket) {
+  if (tuning.cork)
+    set_option(socket, IPPROTO_TCP, TCP_CORK, 0, "clearing TCP_CORK");
+}
 
 int get_socket() {
   int addrinfo_status = 0;
@@ -60,9 +201,10 @@ int get_socket() {
   }
 
   freeaddrinfo(server_info);
+  tune_listener(socket_descriptor);
 
   // listen
-  if (listen(socket_descriptor, PENDING_CONNECTIONS) == -1) {
+  if (listen(socket_descriptor, tuning.backlog) == -1) {
     perror("listen");
     exit(1);
   }
@@ -73,9 +215,12 @@ int get_socket() {
 int accept_connection(int socket_descriptor) {
   struct sockaddr_storage accepted_sockaddr;
   socklen_t accepted_addr_size = sizeof(accepted_sockaddr);
+  // non blocking, so the worker's coroutines can wait on it instead
   int accepted_socket =
-      accept(socket_descriptor, (struct sockaddr *)&accepted_sockaddr,
-             &accepted_addr_size);
+      accept4(socket_descriptor, (struct sockaddr *)&accepted_sockaddr,
+              &accepted_addr_size, SOCK_NONBLOCK);
+  if (accepted_socket != -1)
+    tune_connection(accepted_socket);
 
   return accepted_socket;
 }
@@ -86,8 +231,8 @@ int send_all(int receiving_socket, const char *buffer, long bytes_to_send,
   long total_sent = 0;
 
   while (total_sent < bytes_to_send) {
-    if ((sent_bytes = send(receiving_socket, buffer, bytes_to_send + 1, 0)) ==
-        -1) {
+    if ((sent_bytes = co_send(receiving_socket, buffer + total_sent,
+                              bytes_to_send - total_sent, 0)) == -1) {
       perror("send all");
       return -1;
     }
@@ -97,3 +242,116 @@ int send_all(int receiving_socket, const char *buffer, long bytes_to_send,
 
   return 0;
 }
+
+// socket io that may run inside a coroutine. every call is made non blocking,
+// and whenever it would block the caller waits in coroutine_wait_fd, which
+// parks the coroutine or, on a plain thread, blocks in poll
+long co_recv(int socket, void *buffer, long length, int flags) {
+  while (1) {
+    long received = recv(socket, buffer, length, flags | MSG_DONTWAIT);
+    if (received >= 0) {
+      capture_received(socket, buffer, received);
+      return received;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (coroutine_wait_fd(socket, EPOLLIN) == -1)
+      return -1;
+  }
+}
+
+long co_send(int socket, const void *buffer, long length, int flags) {
+  while (1) {
+    long sent = send(socket, buffer, length, flags | MSG_DONTWAIT);
+    if (sent >= 0) {
+      capture_sent(socket, buffer, sent);
+      return sent;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (coroutine_wait_fd(socket, EPOLLOUT) == -1)
+      return -1;
+  }
+}
+
+// sendfile has no flags argument, so socket has to be O_NONBLOCK already.
+// accepted sockets are
+long co_sendfile(int socket, int file, off_t *offset, long length) {
+  while (1) {
+    long sent = sendfile(socket, file, offset, length);
+    if (sent >= 0) {
+      capture_sent(socket, NULL, sent);
+      return sent;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (coroutine_wait_fd(socket, EPOLLOUT) == -1)
+      return -1;
+  }
+}
+
+// leaves socket non blocking. gives up with ETIMEDOUT after timeout
+// milliseconds, -1 waits as long as the kernel does
+int co_connect(int socket, const struct sockaddr *address, socklen_t length,
+               int timeout) {
+  int flags = fcntl(socket, F_GETFL);
+  if (flags == -1 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+
+  if (connect(socket, address, length) == 0)
+    return 0;
+  if (errno != EINPROGRESS)
+    return -1;
+  if (coroutine_wait_fd_timeout(socket, EPOLLOUT, timeout) == -1)
+    return -1;
+
+  int error = 0;
+  socklen_t error_length = sizeof(error);
+  if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 ||
+      error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+// like send_all for a list of buffers. spans is used up as it goes
+int writev_all(int receiving_socket, struct iovec *spans, int count) {
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+
+  while (count > 0) {
+    message.msg_iov = spans;
+    message.msg_iovlen = count;
+    long written = sendmsg(receiving_socket, &message, MSG_DONTWAIT);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (coroutine_wait_fd(receiving_socket, EPOLLOUT) == -1)
+          return -1;
+        continue;
+      }
+      perror("writev all");
+      return -1;
+    }
+    capture_sent(receiving_socket, spans->iov_base, written);
+
+    while (count > 0 && (size_t)written >= spans->iov_len) {
+      written -= spans->iov_len;
+      spans++;
+      count--;
+    }
+    if (count > 0) {
+      spans->iov_base = (char *)spans->iov_base + written;
+      spans->iov_len -= written;
+    }
+  }
+  return 0;
+}
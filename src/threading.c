@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
 #include "http_server.h"
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 TaskQueue new_task_queue() {
   TaskQueue q;
@@ -47,18 +51,61 @@ Task *new_task(int socket) {
   task->next = NULL;
   task->request = NULL;
   task->socket = socket;
+  task->accepted_at = is_timing_requests() ? monotonic_nanoseconds() : 0;
   return task;
 }
 
-ThreadPool new_thread_pool(void *start_thread, TaskQueue *task_queue) {
-  ThreadPool pool;
+// worker i runs on the cpus where cpu % NUM_THREADS == i, the same mapping
+// submit_task uses to steer connections
+static void pin_worker(Worker *worker) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (long cpu = worker->index; cpu < num_cpus; cpu += NUM_THREADS)
+    CPU_SET(cpu, &cpus);
+  // more workers than cpus, so this one doubles up
+  if (CPU_COUNT(&cpus) == 0)
+    CPU_SET(worker->index % num_cpus, &cpus);
+
+  int status = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+  if (status != 0)
+    fprintf(stderr, "pinning worker %d: %s\n", worker->index,
+            strerror(status));
+}
+
+void start_thread_pool(ThreadPool *pool, void (*serve_task)(Task *)) {
+  pool->next_worker = 0;
 
   for (int i = 0; i < NUM_THREADS; i++) {
-    if (pthread_create(&pool.threads[i], NULL, start_thread,
-                       (void *)task_queue) != 0) {
+    Worker *worker = &pool->workers[i];
+    init_worker(worker, i, serve_task);
+    if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
       fprintf(stderr, "Failed to create thread\n");
+      continue;
     }
+    if (is_steering_connections())
+      pin_worker(worker);
   }
+}
 
-  return pool;
+// a connection goes to the worker on the cpu its packets arrive on when
+// that's known, so the socket stays in one cpu's cache. otherwise workers
+// take turns. only the first task into an empty queue needs to wake the
+// worker, since it drains the whole queue after reading wake_fd
+void submit_task(ThreadPool *pool, Task *task) {
+  int cpu = connection_cpu(task->socket);
+  unsigned index = cpu >= 0 ? (unsigned)cpu : pool->next_worker++;
+  Worker *worker = &pool->workers[index % NUM_THREADS];
+
+  // enqueueing is a critical section against the worker taking tasks
+  pthread_mutex_lock(&worker->queue_mutex);
+  int was_empty = worker->queue.size == 0;
+  enqueue_task(&worker->queue, task);
+  pthread_mutex_unlock(&worker->queue_mutex);
+
+  if (was_empty) {
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) == -1)
+      perror("waking worker");
+  }
 }
@@ -0,0 +1,123 @@
+#include "http_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// USDT probes, for perf and bpftrace. a probe site is a nop until something
+// attaches to it. without sys/sdt.h they compile away entirely
+//   bpftrace -e 'usdt:./tuke_http_server:tuke:stage { @[arg1] = hist(arg2); }'
+//   perf probe -x ./tuke_http_server sdt_tuke:request_done
+#ifdef TUKE_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+// the tracer bumps a probe's semaphore while it's attached, so requests
+// aren't timed for probes nobody is listening to
+unsigned short tuke_stage_semaphore __attribute__((unused))
+__attribute__((section(".probes")));
+unsigned short tuke_request_done_semaphore __attribute__((unused))
+__attribute__((section(".probes")));
+#define IS_PROBED() (tuke_stage_semaphore || tuke_request_done_semaphore)
+#define TRACE_STAGE(socket, index, nanoseconds)                                \
+  DTRACE_PROBE3(tuke, stage, socket, index, nanoseconds)
+#define TRACE_REQUEST_DONE(socket, path, nanoseconds)                          \
+  DTRACE_PROBE3(tuke, request_done, socket, path, nanoseconds)
+#else
+#define IS_PROBED() 0
+#define TRACE_STAGE(socket, index, nanoseconds) ((void)0)
+#define TRACE_REQUEST_DONE(socket, path, nanoseconds) ((void)0)
+#endif
+
+// named for the time spent getting to each stage from the one before
+static const char *stage_names[NUM_STAGES] = {
+    "accept", "queue", "recv", "parse", "open", "send",
+};
+
+// 0 turns the slow request log off
+static uint64_t slow_request_nanoseconds = 0;
+
+uint64_t monotonic_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// slow_request_ms <milliseconds>
+// requests that take longer, from accept to the last byte sent, get their
+// stages logged to stderr
+int set_slow_request_threshold(int argc, char **argv) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: slow_request_ms <milliseconds>\n");
+    return -1;
+  }
+
+  char *end;
+  double milliseconds = strtod(argv[0], &end);
+  if (*end != '\0' || milliseconds < 0) {
+    fprintf(stderr, "slow_request_ms takes a number of milliseconds\n");
+    return -1;
+  }
+  slow_request_nanoseconds = milliseconds * 1e6;
+  return 0;
+}
+
+// reading the clock at every stage is only worth it when something will look
+// at the times
+int is_timing_requests() { return slow_request_nanoseconds || IS_PROBED(); }
+
+// a request accepted before timing was turned on stays untimed
+void start_span(RequestSpan *span, const Task *task) {
+  memset(span, 0, sizeof(*span));
+  span->socket = task->socket;
+  span->is_timed = task->accepted_at != 0;
+  span->at[STAGE_ACCEPTED] = task->accepted_at;
+  trace_stage(span, STAGE_DEQUEUED);
+}
+
+void trace_stage(RequestSpan *span, int stage) {
+  if (!span->is_timed)
+    return;
+  uint64_t now = monotonic_nanoseconds();
+  span->at[stage] = now;
+  TRACE_STAGE(span->socket, stage, now - span->at[STAGE_ACCEPTED]);
+}
+
+// kept so the slow log can say which request it was, after the receive
+// buffer is gone
+void trace_path(RequestSpan *span, const char *path, unsigned length) {
+  if (length > sizeof(span->path) - 1)
+    length = sizeof(span->path) - 1;
+  memcpy(span->path, path, length);
+  span->path[length] = '\0';
+}
+
+void finish_span(RequestSpan *span) {
+  if (!span->is_timed)
+    return;
+  trace_stage(span, STAGE_SENT);
+  uint64_t total = span->at[STAGE_SENT] - span->at[STAGE_ACCEPTED];
+  TRACE_REQUEST_DONE(span->socket, span->path, total);
+
+  // a websocket's request lasts as long as the connection, so it's always
+  // slow and never interesting
+  if (!slow_request_nanoseconds || span->is_long_lived ||
+      total < slow_request_nanoseconds)
+    return;
+
+  char breakdown[256];
+  int length = 0;
+  uint64_t previous = span->at[STAGE_ACCEPTED];
+  for (int stage = STAGE_DEQUEUED; stage < NUM_STAGES; stage++) {
+    // stages a request skipped, like open for a proxied one, count
+    // toward whichever stage comes next
+    if (!span->at[stage])
+      continue;
+    length += snprintf(breakdown + length, sizeof(breakdown) - length,
+                       " %s %.3fms", stage_names[stage],
+                       (span->at[stage] - previous) / 1e6);
+    previous = span->at[stage];
+  }
+
+  fprintf(stderr, "slow request %s: %.3fms,%s\n",
+          span->path[0] ? span->path : "(unparsed)", total / 1e6, breakdown);
+}
@@ -0,0 +1,736 @@
+#include "http_server.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define INITIAL_INPUT_CAPACITY 4096
+#define MAX_FRAME_HEADER 14
+#define MAX_FLUSH_SPANS 64
+
+// close codes, https://datatracker.ietf.org/doc/html/rfc6455#section-7.4.1
+#define CLOSE_PROTOCOL_ERROR 1002
+#define CLOSE_INVALID_DATA 1007
+#define CLOSE_POLICY_VIOLATION 1008
+#define CLOSE_TOO_BIG 1009
+
+static WebSocketRoute websocket_routes[MAX_WEBSOCKET_ROUTES];
+static int websocket_route_count = 0;
+
+static uint32_t rotate_left(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t *hash, const unsigned char *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (int i = 16; i < 80; i++)
+    w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = hash[0], b = hash[1], c = hash[2], d = hash[3], e = hash[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotate_left(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  hash[0] += a;
+  hash[1] += b;
+  hash[2] += c;
+  hash[3] += d;
+  hash[4] += e;
+}
+
+// only ever hashes a handshake key, nothing here needs to be fast
+static void sha1(const unsigned char *data, unsigned long length,
+                 unsigned char *digest) {
+  uint32_t hash[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                      0xC3D2E1F0};
+  unsigned long i = 0;
+  for (; i + 64 <= length; i += 64)
+    sha1_block(hash, data + i);
+
+  unsigned char block[64];
+  unsigned long rest = length - i;
+  memset(block, 0, sizeof(block));
+  memcpy(block, data + i, rest);
+  block[rest] = 0x80;
+  if (rest >= 56) {
+    sha1_block(hash, block);
+    memset(block, 0, sizeof(block));
+  }
+
+  uint64_t bits = (uint64_t)length * 8;
+  for (int j = 0; j < 8; j++)
+    block[63 - j] = (unsigned char)(bits >> (j * 8));
+  sha1_block(hash, block);
+
+  for (int j = 0; j < 20; j++)
+    digest[j] = (unsigned char)(hash[j / 4] >> (24 - (j % 4) * 8));
+}
+
+static void base64_encode(const unsigned char *data, unsigned length,
+                          char *encoded) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned out = 0;
+
+  for (unsigned i = 0; i < length; i += 3) {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < length)
+      group |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length)
+      group |= data[i + 2];
+
+    encoded[out++] = alphabet[(group >> 18) & 63];
+    encoded[out++] = alphabet[(group >> 12) & 63];
+    encoded[out++] = i + 1 < length ? alphabet[(group >> 6) & 63] : '=';
+    encoded[out++] = i + 2 < length ? alphabet[group & 63] : '=';
+  }
+  encoded[out] = '\0';
+}
+
+int register_websocket_route(const char *prefix, WebSocketHandler on_message,
+                             void *user_data) {
+  if (prefix[0] != '/') {
+    fprintf(stderr, "websocket route %s should start with /\n", prefix);
+    return -1;
+  }
+  if (websocket_route_count == MAX_WEBSOCKET_ROUTES) {
+    fprintf(stderr, "too many websocket routes\n");
+    return -1;
+  }
+
+  WebSocketRoute *route = &websocket_routes[websocket_route_count++];
+  memset(route, 0, sizeof(*route));
+  route->prefix.path = strdup(prefix);
+  route->prefix.length = strlen(prefix);
+  route->on_message = on_message;
+  route->user_data = user_data;
+  pthread_mutex_init(&route->mutex, NULL);
+  return 0;
+}
+
+static void broadcast_message(WebSocket *websocket, int opcode,
+                              const char *payload, unsigned long length,
+                              void *user_data) {
+  websocket_broadcast(websocket->route, opcode, payload, length);
+}
+
+// websocket_broadcast <prefix>
+// every message any client sends goes to every client on the route
+int add_websocket_broadcast_route(int argc, char **argv) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: websocket_broadcast /prefix\n");
+    return -1;
+  }
+  return register_websocket_route(argv[0], broadcast_message, NULL);
+}
+
+WebSocketRoute *find_websocket_route(const char *path, unsigned path_length) {
+  int index =
+      longest_route_match(websocket_routes, websocket_route_count,
+                          sizeof(WebSocketRoute), path, path_length);
+  return index == -1 ? NULL : &websocket_routes[index];
+}
+
+// xors the payload with the four byte key, 16 bytes a step where there's
+// SIMD. payloads always start at key byte 0, and the SIMD steps are multiples
+// of four, so the tail starts at key byte 0 again
+void websocket_unmask(char *payload, unsigned long length,
+                      const unsigned char *key) {
+  unsigned long i = 0;
+  uint32_t key32;
+  memcpy(&key32, key, 4);
+
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi32((int)key32);
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(payload + i));
+    _mm_storeu_si128((__m128i *)(payload + i), _mm_xor_si128(chunk, mask));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t mask = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t chunk = vld1q_u8((const uint8_t *)(payload + i));
+    vst1q_u8((uint8_t *)(payload + i), veorq_u8(chunk, mask));
+  }
+#endif
+
+  const uint64_t mask64 = (uint64_t)key32 << 32 | key32;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t chunk;
+    memcpy(&chunk, payload + i, 8);
+    chunk ^= mask64;
+    memcpy(payload + i, &chunk, 8);
+  }
+
+  for (; i < length; i++)
+    payload[i] ^= key[i & 3];
+}
+
+// server frames are never masked or fragmented
+static SharedFrame *make_frame(int opcode, const char *payload,
+                               unsigned long length) {
+  unsigned header = length < 126 ? 2 : length <= 0xFFFF ? 4 : 10;
+  SharedFrame *frame = malloc(sizeof(SharedFrame) + header + length);
+  if (!frame)
+    return NULL;
+
+  frame->references = 1;
+  frame->length = header + length;
+  unsigned char *data = (unsigned char *)frame->data;
+  data[0] = 0x80 | opcode;
+  if (header == 2) {
+    data[1] = length;
+  } else if (header == 4) {
+    data[1] = 126;
+    data[2] = length >> 8;
+    data[3] = length;
+  } else {
+    data[1] = 127;
+    for (int i = 0; i < 8; i++)
+      data[2 + i] = (uint64_t)length >> (56 - i * 8);
+  }
+
+  memcpy(data + header, payload, length);
+  return frame;
+}
+
+static void release_frame(SharedFrame *frame) {
+  if (__atomic_sub_fetch(&frame->references, 1, __ATOMIC_ACQ_REL) == 0)
+    free(frame);
+}
+
+// a full queue means the client isn't keeping up. rather than buffer without
+// bound it gets disconnected
+static int enqueue_frame(WebSocket *websocket, SharedFrame *frame) {
+  pthread_mutex_lock(&websocket->mutex);
+  if (websocket->is_closing) {
+    pthread_mutex_unlock(&websocket->mutex);
+    return -1;
+  }
+  if (websocket->queue_length == WEBSOCKET_QUEUE_LENGTH) {
+    websocket->is_overflowing = 1;
+    pthread_mutex_unlock(&websocket->mutex);
+    wake_coroutine(websocket->coroutine);
+    return -1;
+  }
+
+  __atomic_add_fetch(&frame->references, 1, __ATOMIC_RELAXED);
+  unsigned tail = (websocket->queue_head + websocket->queue_length) %
+                  WEBSOCKET_QUEUE_LENGTH;
+  websocket->queue[tail] = frame;
+  websocket->queue_length++;
+  pthread_mutex_unlock(&websocket->mutex);
+
+  if (websocket->coroutine != current_coroutine())
+    wake_coroutine(websocket->coroutine);
+  return 0;
+}
+
+int websocket_send(WebSocket *websocket, int opcode, const char *payload,
+                   unsigned long length) {
+  SharedFrame *frame = make_frame(opcode, payload, length);
+  if (!frame)
+    return -1;
+  int status = enqueue_frame(websocket, frame);
+  release_frame(frame);
+  return status;
+}
+
+// the frame is serialized once, and every subscriber's queue shares it
+void websocket_broadcast(WebSocketRoute *route, int opcode,
+                         const char *payload, unsigned long length) {
+  SharedFrame *frame = make_frame(opcode, payload, length);
+  if (!frame)
+    return;
+
+  pthread_mutex_lock(&route->mutex);
+  for (WebSocket *subscriber = route->subscribers; subscriber;
+       subscriber = subscriber->next_subscriber)
+    enqueue_frame(subscriber, frame);
+  pthread_mutex_unlock(&route->mutex);
+
+  release_frame(frame);
+}
+
+// the close frame goes in even when the queue is full, and nothing goes in
+// after it
+static void queue_close(WebSocket *websocket, int code) {
+  char payload[2] = {(char)(code >> 8), (char)code};
+  SharedFrame *frame = make_frame(WEBSOCKET_CLOSE, payload, code ? 2 : 0);
+
+  pthread_mutex_lock(&websocket->mutex);
+  if (!websocket->is_closing && frame) {
+    if (websocket->queue_length == WEBSOCKET_QUEUE_LENGTH) {
+      unsigned last = (websocket->queue_head + websocket->queue_length - 1) %
+                      WEBSOCKET_QUEUE_LENGTH;
+      if (websocket->queue_length > 1 || websocket->queue_offset == 0) {
+        release_frame(websocket->queue[last]);
+        websocket->queue_length--;
+      }
+    }
+    if (websocket->queue_length < WEBSOCKET_QUEUE_LENGTH) {
+      unsigned tail = (websocket->queue_head + websocket->queue_length) %
+                      WEBSOCKET_QUEUE_LENGTH;
+      websocket->queue[tail] = frame;
+      websocket->queue_length++;
+      frame = NULL;
+    }
+  }
+  websocket->is_closing = 1;
+  pthread_mutex_unlock(&websocket->mutex);
+
+  if (frame)
+    release_frame(frame);
+}
+
+// sends as much of the queue as the socket takes without blocking, up to
+// MAX_FLUSH_SPANS frames per syscall. returns 1 if frames are still waiting
+// on the socket, 0 once the queue is empty and -1 if the connection is gone
+static int flush_queue(WebSocket *websocket) {
+  struct iovec spans[MAX_FLUSH_SPANS];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+
+  pthread_mutex_lock(&websocket->mutex);
+  while (websocket->queue_length > 0) {
+    int count = 0;
+    for (; count < (int)websocket->queue_length && count < MAX_FLUSH_SPANS;
+         count++) {
+      SharedFrame *frame =
+          websocket->queue[(websocket->queue_head + count) %
+                           WEBSOCKET_QUEUE_LENGTH];
+      long offset = count == 0 ? websocket->queue_offset : 0;
+      spans[count].iov_base = frame->data + offset;
+      spans[count].iov_len = frame->length - offset;
+    }
+
+    message.msg_iov = spans;
+    message.msg_iovlen = count;
+    long sent = sendmsg(websocket->socket, &message, MSG_DONTWAIT);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      int status = errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+      pthread_mutex_unlock(&websocket->mutex);
+      return status;
+    }
+    capture_sent(websocket->socket, spans[0].iov_base, sent);
+
+    while (websocket->queue_length > 0) {
+      SharedFrame *frame = websocket->queue[websocket->queue_head];
+      long left = frame->length - websocket->queue_offset;
+      if (sent < left) {
+        websocket->queue_offset += sent;
+        break;
+      }
+      sent -= left;
+      release_frame(frame);
+      websocket->queue_head =
+          (websocket->queue_head + 1) % WEBSOCKET_QUEUE_LENGTH;
+      websocket->queue_length--;
+      websocket->queue_offset = 0;
+    }
+  }
+  pthread_mutex_unlock(&websocket->mutex);
+  return 0;
+}
+
+// rejects overlong forms, surrogates and anything past U+10FFFF. runs of
+// ascii are skipped 8 bytes at a time
+static int is_valid_utf8(const char *text, unsigned long length) {
+  const unsigned char *bytes = (const unsigned char *)text;
+  unsigned long i = 0;
+
+  while (i < length) {
+    if (i + 8 <= length) {
+      uint64_t word;
+      memcpy(&word, bytes + i, 8);
+      if (!(word & 0x8080808080808080ull)) {
+        i += 8;
+        continue;
+      }
+    }
+
+    unsigned char c = bytes[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+
+    int continuations;
+    unsigned char low = 0x80, high = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+      continuations = 1;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      continuations = 2;
+      if (c == 0xe0)
+        low = 0xa0;
+      else if (c == 0xed)
+        high = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      continuations = 3;
+      if (c == 0xf0)
+        low = 0x90;
+      else if (c == 0xf4)
+        high = 0x8f;
+    } else {
+      return 0;
+    }
+
+    if (continuations >= length - i)
+      return 0;
+    if (bytes[i + 1] < low || bytes[i + 1] > high)
+      return 0;
+    for (int j = 2; j <= continuations; j++) {
+      if ((bytes[i + j] & 0xc0) != 0x80)
+        return 0;
+    }
+    i += continuations + 1;
+  }
+  return 1;
+}
+
+// 1005 and 1006 are never sent, and 1004 and 1015 aren't for endpoints either
+static int is_valid_close_code(int code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) ||
+         (code >= 3000 && code <= 4999);
+}
+
+// https://datatracker.ietf.org/doc/html/rfc6455#section-8.1
+static int deliver(WebSocket *websocket, int opcode, const char *payload,
+                   unsigned long length) {
+  if (opcode == WEBSOCKET_TEXT && !is_valid_utf8(payload, length))
+    return CLOSE_INVALID_DATA;
+
+  WebSocketRoute *route = websocket->route;
+  if (route->on_message)
+    route->on_message(websocket, opcode, payload, length, route->user_data);
+  return 0;
+}
+
+// returns 0, or a close code to end the connection with
+static int handle_frame(WebSocket *websocket, int is_final, int opcode,
+                        const char *payload, unsigned long length) {
+  if (opcode & 0x8) {
+    // control frames can come between the fragments of a message, but are
+    // never fragmented themselves
+    if (!is_final || length > 125)
+      return CLOSE_PROTOCOL_ERROR;
+
+    switch (opcode) {
+    case WEBSOCKET_CLOSE: {
+      // the payload is empty, or a code and then a utf-8 reason
+      if (length == 1)
+        return CLOSE_PROTOCOL_ERROR;
+      int code = length >= 2 ? ((unsigned char)payload[0] << 8 |
+                                (unsigned char)payload[1])
+                             : 0;
+      if (length >= 2 && !is_valid_close_code(code))
+        return CLOSE_PROTOCOL_ERROR;
+      if (length > 2 && !is_valid_utf8(payload + 2, length - 2))
+        return CLOSE_INVALID_DATA;
+      queue_close(websocket, code);
+      return 0;
+    }
+    case WEBSOCKET_PING:
+      websocket_send(websocket, WEBSOCKET_PONG, payload, length);
+      return 0;
+    case WEBSOCKET_PONG:
+      return 0;
+    default:
+      return CLOSE_PROTOCOL_ERROR;
+    }
+  }
+
+  if (opcode == WEBSOCKET_CONTINUATION) {
+    if (!websocket->message_opcode)
+      return CLOSE_PROTOCOL_ERROR;
+  } else if (opcode == WEBSOCKET_TEXT || opcode == WEBSOCKET_BINARY) {
+    if (websocket->message_opcode)
+      return CLOSE_PROTOCOL_ERROR;
+    // the common case, a whole message in one frame, is handed over straight
+    // from the input buffer
+    if (is_final)
+      return deliver(websocket, opcode, payload, length);
+    websocket->message_opcode = opcode;
+    websocket->message_length = 0;
+  } else {
+    return CLOSE_PROTOCOL_ERROR;
+  }
+
+  if (websocket->message_length + length > WEBSOCKET_MAX_MESSAGE)
+    return CLOSE_TOO_BIG;
+  if (!websocket->message) {
+    websocket->message = malloc(WEBSOCKET_MAX_MESSAGE);
+    if (!websocket->message)
+      return CLOSE_TOO_BIG;
+  }
+  memcpy(websocket->message + websocket->message_length, payload, length);
+  websocket->message_length += length;
+
+  if (is_final) {
+    int message_opcode = websocket->message_opcode;
+    websocket->message_opcode = 0;
+    return deliver(websocket, message_opcode, websocket->message,
+                   websocket->message_length);
+  }
+  return 0;
+}
+
+// handles every whole frame in the input buffer and keeps any partial one at
+// the front. returns 0, or a close code to end the connection with
+static int process_input(WebSocket *websocket) {
+  unsigned char *input = (unsigned char *)websocket->input;
+  unsigned position = 0;
+  int close_code = 0;
+
+  while (!close_code && !websocket->is_closing) {
+    unsigned available = websocket->input_length - position;
+    unsigned char *frame = input + position;
+    if (available < 2)
+      break;
+
+    int is_final = frame[0] & 0x80;
+    int opcode = frame[0] & 0x0F;
+    if ((frame[0] & 0x70) || !(frame[1] & 0x80)) {
+      // reserved bits without an extension, or a client frame without a mask
+      close_code = CLOSE_PROTOCOL_ERROR;
+      break;
+    }
+
+    unsigned header = 2;
+    uint64_t length = frame[1] & 0x7F;
+    if (length == 126) {
+      header = 4;
+      if (available < header)
+        break;
+      length = (uint64_t)frame[2] << 8 | frame[3];
+    } else if (length == 127) {
+      header = 10;
+      if (available < header)
+        break;
+      length = 0;
+      for (int i = 0; i < 8; i++)
+        length = length << 8 | frame[2 + i];
+    }
+    header += 4;
+
+    if (length > WEBSOCKET_MAX_FRAME) {
+      close_code = CLOSE_TOO_BIG;
+      break;
+    }
+    if (available < header + length) {
+      // make room for the whole frame, it's at most MAX_FRAME_HEADER plus
+      // WEBSOCKET_MAX_FRAME
+      if (header + length > websocket->input_capacity) {
+        char *grown = realloc(websocket->input, header + length);
+        if (!grown) {
+          close_code = CLOSE_TOO_BIG;
+          break;
+        }
+        websocket->input = grown;
+        websocket->input_capacity = header + length;
+        input = (unsigned char *)grown;
+      }
+      break;
+    }
+
+    char *payload = (char *)frame + header;
+    websocket_unmask(payload, length, frame + header - 4);
+    close_code = handle_frame(websocket, is_final, opcode, payload, length);
+    position += header + length;
+  }
+
+  websocket->input_length -= position;
+  memmove(websocket->input, websocket->input + position,
+          websocket->input_length);
+  return close_code;
+}
+
+// https://datatracker.ietf.org/doc/html/rfc6455#section-4.2
+static int send_handshake(int client_socket, const HTTP_Request *request) {
+  const Header *key = find_header(request, "Sec-WebSocket-Key");
+  const Header *version = find_header(request, "Sec-WebSocket-Version");
+  RequestLine request_line = request->request_line;
+
+  if (request_line.method_length != 3 ||
+      memcmp(request_line.method, "GET", 3) != 0 ||
+      !header_has_token(find_header(request, "Upgrade"), "websocket") ||
+      !header_has_token(find_header(request, "Connection"), "upgrade") ||
+      !key ||
+      key->body_length != 24 || !version || version->body_length != 2 ||
+      memcmp(version->body_string, "13", 2) != 0)
+    return -1;
+
+  unsigned char accept_source[24 + sizeof(WEBSOCKET_GUID) - 1];
+  memcpy(accept_source, key->body_string, 24);
+  memcpy(accept_source + 24, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+  unsigned char digest[20];
+  sha1(accept_source, sizeof(accept_source), digest);
+  char accept[29];
+  base64_encode(digest, 20, accept);
+
+  char response[256];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: %s\r\n\r\n",
+                        accept);
+  long sent_bytes;
+  return send_all(client_socket, response, length, &sent_bytes);
+}
+
+static void subscribe(WebSocketRoute *route, WebSocket *websocket) {
+  pthread_mutex_lock(&route->mutex);
+  websocket->next_subscriber = route->subscribers;
+  if (route->subscribers)
+    route->subscribers->previous_subscriber = websocket;
+  route->subscribers = websocket;
+  route->num_subscribers++;
+  pthread_mutex_unlock(&route->mutex);
+}
+
+static void unsubscribe(WebSocketRoute *route, WebSocket *websocket) {
+  pthread_mutex_lock(&route->mutex);
+  if (websocket->previous_subscriber)
+    websocket->previous_subscriber->next_subscriber =
+        websocket->next_subscriber;
+  else
+    route->subscribers = websocket->next_subscriber;
+  if (websocket->next_subscriber)
+    websocket->next_subscriber->previous_subscriber =
+        websocket->previous_subscriber;
+  route->num_subscribers--;
+  pthread_mutex_unlock(&route->mutex);
+}
+
+static void free_websocket(WebSocket *websocket) {
+  while (websocket->queue_length > 0) {
+    release_frame(websocket->queue[websocket->queue_head]);
+    websocket->queue_head =
+        (websocket->queue_head + 1) % WEBSOCKET_QUEUE_LENGTH;
+    websocket->queue_length--;
+  }
+  pthread_mutex_destroy(&websocket->mutex);
+  free(websocket->input);
+  free(websocket->message);
+  free(websocket);
+}
+
+// runs the connection until either side closes it. returns -1 without
+// touching the socket if the request isn't a websocket handshake. raw is the
+// receive buffer, in case the client's first frames came along with it
+int serve_websocket(int client_socket, WebSocketRoute *route,
+                    const HTTP_Request *request, const char *raw,
+                    unsigned raw_length) {
+  Coroutine *coroutine = current_coroutine();
+  if (!coroutine)
+    return -1;
+  if (send_handshake(client_socket, request) == -1)
+    return -1;
+
+  WebSocket *websocket = calloc(1, sizeof(WebSocket));
+  unsigned early_bytes = raw_length > request->header_bytes
+                             ? raw_length - request->header_bytes
+                             : 0;
+  unsigned capacity = early_bytes > INITIAL_INPUT_CAPACITY
+                          ? early_bytes
+                          : INITIAL_INPUT_CAPACITY;
+  if (!websocket || !(websocket->input = malloc(capacity))) {
+    free(websocket);
+    return 0;
+  }
+
+  websocket->socket = client_socket;
+  websocket->coroutine = coroutine;
+  websocket->route = route;
+  websocket->input_capacity = capacity;
+  pthread_mutex_init(&websocket->mutex, NULL);
+  memcpy(websocket->input, raw + request->header_bytes, early_bytes);
+  websocket->input_length = early_bytes;
+  subscribe(route, websocket);
+
+  int close_code = early_bytes ? process_input(websocket) : 0;
+  while (1) {
+    if (close_code)
+      queue_close(websocket, close_code);
+    close_code = 0;
+
+    int pending = flush_queue(websocket);
+    if (pending == -1)
+      break;
+    if (websocket->is_overflowing && !websocket->is_closing) {
+      queue_close(websocket, CLOSE_POLICY_VIOLATION);
+      continue;
+    }
+    // our close frame is out, so the connection is done
+    if (websocket->is_closing && !pending)
+      break;
+
+    if (websocket->input_length == websocket->input_capacity)
+      websocket->input_length = 0;
+    long received = recv(client_socket,
+                         websocket->input + websocket->input_length,
+                         websocket->input_capacity - websocket->input_length,
+                         MSG_DONTWAIT);
+    if (received >= 0)
+      capture_received(client_socket,
+                       websocket->input + websocket->input_length, received);
+    if (received > 0) {
+      websocket->input_length += received;
+      if (!websocket->is_closing)
+        close_code = process_input(websocket);
+      else
+        websocket->input_length = 0;
+      // a client that never stops sending mustn't hog the worker
+      coroutine_yield();
+      continue;
+    }
+    if (received == 0)
+      break;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      break;
+
+    coroutine_wait_fd_or_wake(client_socket,
+                              EPOLLIN | (pending ? EPOLLOUT : 0));
+  }
+
+  unsubscribe(route, websocket);
+  free_websocket(websocket);
+  return 0;
+}
@@ -0,0 +1,327 @@
+// packs a directory of static files into one bundle the server can mmap
+// usage: pack_assets <directory> <bundle>
+#include "http_server.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef TUKE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define MAX_PATH_LENGTH 1024
+#define MAX_HEADERS_LENGTH 512
+
+typedef struct {
+  char *path;
+  char *body;
+  long body_length;
+  char *gzip_body;
+  long gzip_body_length;
+  char headers[MAX_HEADERS_LENGTH];
+  unsigned headers_length;
+  char gzip_headers[MAX_HEADERS_LENGTH];
+  unsigned gzip_headers_length;
+  char etag[ASSET_ETAG_LENGTH];
+  char gzip_etag[ASSET_ETAG_LENGTH];
+} Asset;
+
+static Asset *assets = NULL;
+static int num_assets = 0;
+static int assets_capacity = 0;
+
+static const char *content_type_for(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (!dot)
+    return "application/octet-stream";
+  if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0)
+    return "text/html; charset=utf-8";
+  if (strcmp(dot, ".css") == 0)
+    return "text/css; charset=utf-8";
+  if (strcmp(dot, ".js") == 0)
+    return "text/javascript; charset=utf-8";
+  if (strcmp(dot, ".txt") == 0)
+    return "text/plain; charset=utf-8";
+  if (strcmp(dot, ".json") == 0)
+    return "application/json";
+  if (strcmp(dot, ".png") == 0)
+    return "image/png";
+  if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0)
+    return "image/jpeg";
+  if (strcmp(dot, ".svg") == 0)
+    return "image/svg+xml";
+  if (strcmp(dot, ".ico") == 0)
+    return "image/ico";
+  return "application/octet-stream";
+}
+
+// fnv-1a over the contents, so the etag only changes when the file does. the
+// gzip variant's etag is the same with -gz on the end
+static void make_etags(const char *body, long length, char *etag,
+                       char *gzip_etag) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (long i = 0; i < length; i++) {
+    hash ^= (unsigned char)body[i];
+    hash *= 0x100000001b3ull;
+  }
+  snprintf(etag, ASSET_ETAG_LENGTH, "\"%016llx\"", (unsigned long long)hash);
+  snprintf(gzip_etag, ASSET_ETAG_LENGTH, "\"%016llx-gz\"",
+           (unsigned long long)hash);
+}
+
+#ifdef TUKE_HAVE_ZLIB
+// text compresses, images and the like are already compressed
+static int is_compressible(const char *content_type) {
+  return strncmp(content_type, "text/", 5) == 0 ||
+         strcmp(content_type, "application/json") == 0 ||
+         strcmp(content_type, "image/svg+xml") == 0;
+}
+
+static char *gzip(const char *body, long length, long *gzip_length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 + 15 window bits asks for a gzip wrapper instead of raw zlib
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  uLong bound = deflateBound(&stream, length);
+  char *out = malloc(bound);
+  stream.next_in = (Bytef *)body;
+  stream.avail_in = length;
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = bound;
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&stream);
+    free(out);
+    return NULL;
+  }
+
+  *gzip_length = stream.total_out;
+  deflateEnd(&stream);
+  return out;
+}
+#endif
+
+static char *read_whole_file(const char *path, long *length) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  char *body = malloc(size ? size : 1);
+  if (fread(body, 1, size, file) != (size_t)size) {
+    free(body);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+  *length = size;
+  return body;
+}
+
+static void add_asset(const char *file_path, const char *url_path) {
+  Asset asset;
+  memset(&asset, 0, sizeof(asset));
+
+  asset.body = read_whole_file(file_path, &asset.body_length);
+  if (!asset.body) {
+    fprintf(stderr, "skipping unreadable %s\n", file_path);
+    return;
+  }
+
+  asset.path = strdup(url_path);
+  make_etags(asset.body, asset.body_length, asset.etag, asset.gzip_etag);
+  const char *content_type = content_type_for(url_path);
+
+#ifdef TUKE_HAVE_ZLIB
+  if (is_compressible(content_type)) {
+    asset.gzip_body = gzip(asset.body, asset.body_length,
+                           &asset.gzip_body_length);
+    // not worth a second copy unless it saves something real
+    if (asset.gzip_body &&
+        asset.gzip_body_length > asset.body_length * 9 / 10) {
+      free(asset.gzip_body);
+      asset.gzip_body = NULL;
+      asset.gzip_body_length = 0;
+    }
+  }
+#endif
+
+  // with two variants, caches have to key on Accept-Encoding for either one
+  const char *vary = asset.gzip_body ? "Vary: Accept-Encoding\r\n" : "";
+  asset.headers_length = snprintf(
+      asset.headers, MAX_HEADERS_LENGTH,
+      "HTTP/1.0 200\r\nContent-Length: %ld\r\nContent-Type: %s\r\n%sETag: "
+      "%s\r\n\r\n",
+      asset.body_length, content_type, vary, asset.etag);
+
+  if (asset.gzip_body) {
+    asset.gzip_headers_length = snprintf(
+        asset.gzip_headers, MAX_HEADERS_LENGTH,
+        "HTTP/1.0 200\r\nContent-Length: %ld\r\nContent-Type: "
+        "%s\r\nContent-Encoding: gzip\r\n%sETag: %s\r\n\r\n",
+        asset.gzip_body_length, content_type, vary, asset.gzip_etag);
+  }
+
+  if (num_assets == assets_capacity) {
+    assets_capacity = assets_capacity ? assets_capacity * 2 : 16;
+    assets = realloc(assets, sizeof(Asset) * assets_capacity);
+  }
+  assets[num_assets++] = asset;
+}
+
+static void walk_directory(const char *directory, const char *url_prefix) {
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    perror("opendir");
+    exit(1);
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    char file_path[MAX_PATH_LENGTH];
+    char url_path[MAX_PATH_LENGTH];
+    snprintf(file_path, MAX_PATH_LENGTH, "%s/%s", directory, entry->d_name);
+    snprintf(url_path, MAX_PATH_LENGTH, "%s/%s", url_prefix, entry->d_name);
+
+    struct stat file_stat;
+    if (stat(file_path, &file_stat) == -1)
+      continue;
+
+    if (S_ISDIR(file_stat.st_mode)) {
+      walk_directory(file_path, url_path);
+    } else if (S_ISREG(file_stat.st_mode)) {
+      // files like a_forbidden_file.html are kept out by their mode, which
+      // root could read through anyway
+      if (!(file_stat.st_mode & S_IRUSR)) {
+        fprintf(stderr, "skipping %s, its owner can't read it\n", file_path);
+        continue;
+      }
+      add_asset(file_path, url_path);
+    }
+  }
+
+  closedir(dir);
+}
+
+// plain byte order, the same order find_asset searches in
+static int compare_assets(const void *a, const void *b) {
+  const char *path_a = ((const Asset *)a)->path;
+  const char *path_b = ((const Asset *)b)->path;
+  return strcmp(path_a, path_b);
+}
+
+static uint64_t align_to_page(uint64_t offset) {
+  return (offset + ASSET_PAGE_SIZE - 1) & ~(uint64_t)(ASSET_PAGE_SIZE - 1);
+}
+
+static void write_at(FILE *file, uint64_t offset, const void *data,
+                     uint64_t length) {
+  if (fseek(file, offset, SEEK_SET) == -1 ||
+      fwrite(data, 1, length, file) != length) {
+    perror("writing bundle");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: pack_assets <directory> <bundle>\n");
+    return 1;
+  }
+
+  walk_directory(argv[1], "");
+  qsort(assets, num_assets, sizeof(Asset), compare_assets);
+
+  AssetEntry *entries = calloc(num_assets ? num_assets : 1, sizeof(AssetEntry));
+  uint64_t offset = sizeof(AssetBundleHeader);
+  uint64_t entries_offset = offset;
+  offset += sizeof(AssetEntry) * num_assets;
+
+  // paths and headers are packed together right after the index, so a lookup
+  // and the headers it needs usually share a page or two
+  for (int i = 0; i < num_assets; i++) {
+    entries[i].path_offset = offset;
+    entries[i].path_length = strlen(assets[i].path);
+    offset += entries[i].path_length;
+
+    entries[i].headers_offset = offset;
+    entries[i].headers_length = assets[i].headers_length;
+    offset += assets[i].headers_length;
+
+    entries[i].gzip_headers_offset = offset;
+    entries[i].gzip_headers_length = assets[i].gzip_headers_length;
+    offset += assets[i].gzip_headers_length;
+
+    memcpy(entries[i].etag, assets[i].etag, ASSET_ETAG_LENGTH);
+    memcpy(entries[i].gzip_etag, assets[i].gzip_etag, ASSET_ETAG_LENGTH);
+  }
+
+  for (int i = 0; i < num_assets; i++) {
+    offset = align_to_page(offset);
+    entries[i].body_offset = offset;
+    entries[i].body_length = assets[i].body_length;
+    offset += assets[i].body_length;
+
+    if (assets[i].gzip_body) {
+      offset = align_to_page(offset);
+      entries[i].gzip_body_offset = offset;
+      entries[i].gzip_body_length = assets[i].gzip_body_length;
+      offset += assets[i].gzip_body_length;
+    }
+  }
+
+  AssetBundleHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ASSET_BUNDLE_MAGIC, sizeof(header.magic));
+  header.version = ASSET_BUNDLE_VERSION;
+  header.num_assets = num_assets;
+  header.entries_offset = entries_offset;
+  header.file_size = offset;
+
+  FILE *bundle = fopen(argv[2], "wb");
+  if (!bundle) {
+    perror("opening bundle");
+    return 1;
+  }
+
+  write_at(bundle, 0, &header, sizeof(header));
+  write_at(bundle, entries_offset, entries, sizeof(AssetEntry) * num_assets);
+  for (int i = 0; i < num_assets; i++) {
+    AssetEntry *entry = &entries[i];
+    write_at(bundle, entry->path_offset, assets[i].path, entry->path_length);
+    write_at(bundle, entry->headers_offset, assets[i].headers,
+             entry->headers_length);
+    write_at(bundle, entry->gzip_headers_offset, assets[i].gzip_headers,
+             entry->gzip_headers_length);
+    write_at(bundle, entry->body_offset, assets[i].body, entry->body_length);
+    if (assets[i].gzip_body)
+      write_at(bundle, entry->gzip_body_offset, assets[i].gzip_body,
+               entry->gzip_body_length);
+  }
+
+  // an empty last body is never written, make sure the file still reaches
+  // file_size
+  fflush(bundle);
+  if (ftruncate(fileno(bundle), offset) == -1) {
+    perror("sizing bundle");
+    return 1;
+  }
+
+  fclose(bundle);
+  printf("packed %d assets into %s, %llu bytes\n", num_assets, argv[2],
+         (unsigned long long)offset);
+  return 0;
+}
@@ -0,0 +1,458 @@
+// replays a traffic capture against a running server, with the same
+// connections sending the same bytes in the same pieces, and reports any
+// response whose status or length differs from what was captured
+// usage: replay_capture <capture> [speed] [host] [port]
+// speed 1 keeps the original timing, 2 is twice as fast, max doesn't wait
+// websocket connections are skipped. what the server sends on one depends on
+// every other client on the route, so there's nothing fixed to compare
+#define _GNU_SOURCE
+#include "http_server.h"
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_IN_FLIGHT 256
+#define MAX_REPORTED_MISMATCHES 20
+#define MAX_EVENTS 64
+// a connection waiting this long on the server, with nothing left to send, is
+// given up on
+#define IDLE_TIMEOUT_NANOSECONDS (10 * 1000000000ull)
+
+typedef struct {
+  uint64_t timestamp;
+  const char *data;
+  uint32_t length;
+} Chunk;
+
+typedef struct {
+  uint64_t id;
+  int has_open;
+  uint64_t opened_at;
+  Chunk *chunks;
+  int num_chunks;
+  int chunks_capacity;
+  int has_close;
+  uint64_t closed_at;
+  int has_end;
+  int has_dropped;
+  int status;
+  uint64_t length;
+
+  // replay
+  int socket;
+  int next_chunk;
+  int is_half_closed;
+  uint64_t last_activity;
+  uint64_t started_at;
+  uint64_t finished_at;
+  char status_line[16];
+  int status_line_length;
+  uint64_t received;
+} Connection;
+
+static Connection *connections = NULL;
+static uint64_t num_connections = 0;
+static double speed = 1;
+static uint64_t replay_start;
+static uint64_t capture_start;
+
+static uint64_t now_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static char *read_whole_file(const char *path, long *length) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  char *contents = malloc(size ? size : 1);
+  if (fread(contents, 1, size, file) != (size_t)size) {
+    free(contents);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+  *length = size;
+  return contents;
+}
+
+static Connection *connection_for(uint64_t id) {
+  if (id >= num_connections) {
+    uint64_t capacity = num_connections ? num_connections : 1024;
+    while (capacity <= id)
+      capacity *= 2;
+    connections = realloc(connections, capacity * sizeof(Connection));
+    memset(connections + num_connections, 0,
+           (capacity - num_connections) * sizeof(Connection));
+    for (uint64_t i = num_connections; i < capacity; i++)
+      connections[i].id = i;
+    num_connections = capacity;
+  }
+  return &connections[id];
+}
+
+// the log can end partway through a record if the server was killed, what's
+// whole is still usable
+static void parse_capture(const char *capture, long length) {
+  const CaptureHeader *header = (const CaptureHeader *)capture;
+  if (length < (long)sizeof(CaptureHeader) ||
+      memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != CAPTURE_VERSION) {
+    fprintf(stderr, "not a version %d capture\n", CAPTURE_VERSION);
+    exit(1);
+  }
+
+  long position = sizeof(CaptureHeader);
+  while (position + (long)sizeof(CaptureRecord) <= length) {
+    CaptureRecord record;
+    memcpy(&record, capture + position, sizeof(record));
+    position += sizeof(record);
+
+    Connection *connection = connection_for(record.connection);
+    if (record.type == CAPTURE_OPEN) {
+      connection->has_open = 1;
+      connection->opened_at = record.timestamp;
+    } else if (record.type == CAPTURE_DATA) {
+      if (position + record.length > length)
+        break;
+      if (connection->num_chunks == connection->chunks_capacity) {
+        connection->chunks_capacity =
+            connection->chunks_capacity ? connection->chunks_capacity * 2 : 4;
+        connection->chunks = realloc(
+            connection->chunks, connection->chunks_capacity * sizeof(Chunk));
+      }
+      Chunk chunk = {record.timestamp, capture + position, record.length};
+      connection->chunks[connection->num_chunks++] = chunk;
+      position += record.length;
+    } else if (record.type == CAPTURE_CLOSE) {
+      connection->has_close = 1;
+      connection->closed_at = record.timestamp;
+    } else if (record.type == CAPTURE_DROPPED) {
+      connection->has_dropped = 1;
+    } else if (record.type == CAPTURE_END) {
+      connection->has_end = 1;
+      connection->status = record.status;
+      connection->length = record.length;
+    } else {
+      fprintf(stderr, "unknown record type %d, stopping there\n",
+              record.type);
+      break;
+    }
+  }
+}
+
+static int compare_opened_at(const void *a, const void *b) {
+  const Connection *x = *(Connection *const *)a;
+  const Connection *y = *(Connection *const *)b;
+  return (x->opened_at > y->opened_at) - (x->opened_at < y->opened_at);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// nanoseconds into the replay at which something captured at timestamp
+// should happen
+static uint64_t scheduled(uint64_t timestamp) {
+  if (speed == 0 || timestamp < capture_start)
+    return 0;
+  return (timestamp - capture_start) / speed;
+}
+
+// when the connection next has something to send, or UINT64_MAX once it's
+// sent everything, including its half close
+static uint64_t next_due(const Connection *connection) {
+  if (connection->next_chunk < connection->num_chunks)
+    return scheduled(connection->chunks[connection->next_chunk].timestamp);
+  if (connection->has_close && !connection->is_half_closed)
+    return scheduled(connection->closed_at);
+  return UINT64_MAX;
+}
+
+static void send_due_chunks(Connection *connection, uint64_t now) {
+  while (next_due(connection) <= now) {
+    connection->last_activity = now_nanoseconds();
+    if (connection->next_chunk == connection->num_chunks) {
+      // the client shut its side here during capture
+      shutdown(connection->socket, SHUT_WR);
+      connection->is_half_closed = 1;
+      return;
+    }
+    Chunk *chunk = &connection->chunks[connection->next_chunk];
+    connection->next_chunk++;
+
+    // the server may have answered and closed already, that's what it did
+    // during capture too
+    long sent = 0;
+    while (sent < chunk->length) {
+      long result = send(connection->socket, chunk->data + sent,
+                         chunk->length - sent, MSG_NOSIGNAL);
+      if (result == -1) {
+        if (errno == EINTR)
+          continue;
+        return;
+      }
+      sent += result;
+    }
+  }
+}
+
+// returns 1 once the server has closed the connection
+static int read_response(Connection *connection) {
+  char buffer[16384];
+  while (1) {
+    long received =
+        recv(connection->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received == 0)
+      return 1;
+    if (received == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+    }
+
+    int wanted = (int)sizeof(connection->status_line) -
+                 connection->status_line_length;
+    if (wanted > 0) {
+      int taken = received < wanted ? received : wanted;
+      memcpy(connection->status_line + connection->status_line_length, buffer,
+             taken);
+      connection->status_line_length += taken;
+    }
+    connection->received += received;
+    connection->last_activity = now_nanoseconds();
+  }
+}
+
+static int replayed_status(const Connection *connection) {
+  if (connection->status_line_length < 12 ||
+      memcmp(connection->status_line, "HTTP/1.", 7) != 0)
+    return 0;
+  char code[4];
+  memcpy(code, connection->status_line + 9, 3);
+  code[3] = '\0';
+  return atoi(code);
+}
+
+// for naming a connection in a mismatch report
+static int request_line_length(const Connection *connection) {
+  if (!connection->num_chunks)
+    return 0;
+  const Chunk *chunk = &connection->chunks[0];
+  const char *end = memchr(chunk->data, '\r', chunk->length);
+  return end ? end - chunk->data : (int)chunk->length;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: replay_capture <capture> [speed|max] [host] "
+                    "[port]\n");
+    return 1;
+  }
+  if (argc > 2)
+    speed = strcmp(argv[2], "max") == 0 ? 0 : atof(argv[2]);
+  const char *host = argc > 3 ? argv[3] : "127.0.0.1";
+  const char *port = argc > 4 ? argv[4] : "5556";
+  if (speed < 0) {
+    fprintf(stderr, "speed should be positive, or max\n");
+    return 1;
+  }
+
+  long capture_length;
+  char *capture = read_whole_file(argv[1], &capture_length);
+  if (!capture) {
+    perror("reading capture");
+    return 1;
+  }
+  parse_capture(capture, capture_length);
+
+  // connections that lost records to a full capture buffer, their open record
+  // or any other, can't be replayed faithfully
+  Connection **order = malloc((num_connections + 1) * sizeof(Connection *));
+  uint64_t total = 0;
+  uint64_t upgraded = 0;
+  uint64_t incomplete = 0;
+  for (uint64_t i = 0; i < num_connections; i++) {
+    if (connections[i].has_dropped) {
+      incomplete++;
+      continue;
+    }
+    if (!connections[i].has_open)
+      continue;
+    if (connections[i].has_end && connections[i].status == 101) {
+      upgraded++;
+      continue;
+    }
+    order[total++] = &connections[i];
+  }
+  if (upgraded)
+    printf("skipping %llu websocket connections\n",
+           (unsigned long long)upgraded);
+  if (incomplete)
+    printf("skipping %llu connections the capture dropped records from\n",
+           (unsigned long long)incomplete);
+  if (total == 0) {
+    fprintf(stderr, "nothing to replay\n");
+    return 1;
+  }
+  qsort(order, total, sizeof(Connection *), compare_opened_at);
+  capture_start = order[0]->opened_at;
+
+  struct addrinfo hints, *address;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &address) != 0) {
+    fprintf(stderr, "can't resolve %s:%s\n", host, port);
+    return 1;
+  }
+
+  int epoll_fd = epoll_create1(0);
+  Connection *in_flight[MAX_IN_FLIGHT];
+  int num_in_flight = 0;
+  uint64_t next = 0;
+  uint64_t finished = 0;
+  uint64_t status_mismatches = 0;
+  uint64_t length_mismatches = 0;
+  uint64_t failed = 0;
+  uint64_t timed_out = 0;
+  int reported = 0;
+  replay_start = now_nanoseconds();
+
+  while (finished < total) {
+    uint64_t now = now_nanoseconds() - replay_start;
+
+    while (next < total && num_in_flight < MAX_IN_FLIGHT &&
+           scheduled(order[next]->opened_at) <= now) {
+      Connection *connection = order[next++];
+      connection->started_at = now_nanoseconds();
+      connection->socket = socket(address->ai_family, address->ai_socktype,
+                                  address->ai_protocol);
+      if (connection->socket == -1 ||
+          connect(connection->socket, address->ai_addr,
+                  address->ai_addrlen) == -1) {
+        perror("connect");
+        if (connection->socket != -1)
+          close(connection->socket);
+        failed++;
+        finished++;
+        continue;
+      }
+      struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->socket, &event);
+      connection->last_activity = now_nanoseconds();
+      in_flight[num_in_flight++] = connection;
+    }
+
+    // sleep until the next connection or chunk is due, or a response comes
+    uint64_t wake_at = UINT64_MAX;
+    if (next < total && num_in_flight < MAX_IN_FLIGHT)
+      wake_at = scheduled(order[next]->opened_at);
+    for (int i = 0; i < num_in_flight; i++) {
+      Connection *connection = in_flight[i];
+      send_due_chunks(connection, now);
+      uint64_t due = next_due(connection);
+      if (due < wake_at)
+        wake_at = due;
+
+      // one stuck connection mustn't hold up the whole replay. one that was
+      // still open when capture stopped was stuck then too
+      if (due == UINT64_MAX &&
+          now_nanoseconds() - connection->last_activity >
+              IDLE_TIMEOUT_NANOSECONDS) {
+        if (connection->has_end && reported++ < MAX_REPORTED_MISMATCHES)
+          printf("connection %llu (%.*s): no response for %llus, giving up\n",
+                 (unsigned long long)connection->id,
+                 request_line_length(connection),
+                 connection->num_chunks ? connection->chunks[0].data : "",
+                 IDLE_TIMEOUT_NANOSECONDS / 1000000000);
+        timed_out += connection->has_end;
+        close(connection->socket);
+        in_flight[i--] = in_flight[--num_in_flight];
+        finished++;
+      }
+    }
+    int timeout = 1000;
+    if (wake_at != UINT64_MAX) {
+      now = now_nanoseconds() - replay_start;
+      timeout = wake_at <= now ? 0 : (wake_at - now + 999999) / 1000000;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < ready; i++) {
+      Connection *connection = events[i].data.ptr;
+      if (!read_response(connection))
+        continue;
+
+      connection->finished_at = now_nanoseconds();
+      close(connection->socket);
+      for (int j = 0; j < num_in_flight; j++) {
+        if (in_flight[j] == connection) {
+          in_flight[j] = in_flight[--num_in_flight];
+          break;
+        }
+      }
+      finished++;
+
+      // a connection still open when capture stopped has nothing to check
+      if (!connection->has_end)
+        continue;
+      int status = replayed_status(connection);
+      int is_status_different = status != connection->status;
+      int is_length_different = connection->received != connection->length;
+      status_mismatches += is_status_different;
+      length_mismatches += is_length_different;
+      if ((is_status_different || is_length_different) &&
+          reported++ < MAX_REPORTED_MISMATCHES) {
+        printf("connection %llu (%.*s): status %d -> %d, length %llu -> "
+               "%llu\n",
+               (unsigned long long)connection->id,
+               request_line_length(connection),
+               connection->num_chunks ? connection->chunks[0].data : "",
+               connection->status, status,
+               (unsigned long long)connection->length,
+               (unsigned long long)connection->received);
+      }
+    }
+  }
+
+  double elapsed = (now_nanoseconds() - replay_start) / 1e9;
+  double original = (order[total - 1]->opened_at - capture_start) / 1e9;
+  uint64_t *latencies = malloc(total * sizeof(uint64_t));
+  uint64_t num_latencies = 0;
+  for (uint64_t i = 0; i < total; i++) {
+    if (order[i]->finished_at)
+      latencies[num_latencies++] = order[i]->finished_at - order[i]->started_at;
+  }
+  qsort(latencies, num_latencies, sizeof(uint64_t), compare_u64);
+
+  printf("replayed %llu connections in %.3fs, %.0f per second (captured over "
+         "%.3fs)\n",
+         (unsigned long long)total, elapsed, total / elapsed, original);
+  if (num_latencies)
+    printf("connection latency p50 %.3fms p99 %.3fms\n",
+           latencies[num_latencies / 2] / 1e6,
+           latencies[num_latencies * 99 / 100] / 1e6);
+  printf("%llu status mismatches, %llu length mismatches, %llu failed to "
+         "connect, %llu timed out\n",
+         (unsigned long long)status_mismatches,
+         (unsigned long long)length_mismatches, (unsigned long long)failed,
+         (unsigned long long)timed_out);
+  return status_mismatches || length_mismatches || failed || timed_out ? 1
+                                                                       : 0;
+}